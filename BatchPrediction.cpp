@@ -0,0 +1,288 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "BatchPrediction.h"
+#include "FileReader.h"
+#include "RotationSweep.h"
+#include "StateFile.h"
+#include <iostream>
+#include <fstream>
+
+BatchPrediction::BatchPrediction()
+{
+	_detector.setCrystal(&_crystal);
+}
+
+bool BatchPrediction::loadGeometry(std::string filename)
+{
+	PanelGeometry panels;
+
+	if (!panels.load(filename))
+	{
+		return false;
+	}
+
+	_geometry = panels;
+	_detector.setGeometry(_geometry);
+
+	return true;
+}
+
+/* Every frame starts from the defaults, so that a field missing from
+ * one state file never inherits the previous frame's value. Only the
+ * geometry is shared by the whole batch. */
+void BatchPrediction::resetFrame()
+{
+	_crystal = Crystal();
+	_detector = Detector();
+	_detector.setCrystal(&_crystal);
+	_detector.setGeometry(_geometry);
+}
+
+bool BatchPrediction::loadMatrix(std::string filename)
+{
+	std::string error;
+
+	if (!load_state_file(filename, &_crystal, &_detector, &error))
+	{
+		std::cout << error << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+void BatchPrediction::writePredictions(std::string filename, int width,
+                                       int height)
+{
+	std::ofstream file;
+	file.open(filename.c_str());
+
+	vec3 beamCentre = _detector.getBeamCentre();
+	int count = 0;
+
+	file << "# h k l x y weight" << std::endl;
+
+	const std::vector<VisibleSpot> &spots = _detector.visibleSpots();
+
+	for (size_t i = 0; i < spots.size(); i++)
+	{
+		double weight = spots[i].weight;
+		double x = spots[i].x + beamCentre.x;
+		double y = spots[i].y + beamCentre.y;
+
+		if (x < 0 || y < 0 || x >= width || y >= height)
+		{
+			continue;
+		}
+
+		int h, k, l;
+		_crystal.getMillerHKL(spots[i].index, &h, &k, &l);
+
+		file << h << " " << k << " " << l << " " << x << " " << y << " "
+		<< weight << std::endl;
+		count++;
+	}
+
+	file.close();
+
+	std::cout << "Wrote " << count << " predictions to " << filename
+	<< std::endl;
+}
+
+static std::string outputBase(std::string matrixFile)
+{
+	std::string outName = matrixFile;
+	size_t pos = outName.rfind(".");
+
+	if (pos != std::string::npos && pos > outName.rfind("/") + 1)
+	{
+		outName = outName.substr(0, pos);
+	}
+
+	return outName;
+}
+
+bool BatchPrediction::predictFrame(std::string matrixFile, int width,
+                                   int height)
+{
+	resetFrame();
+
+	/* Unless the matrix says otherwise, assume the beam hits the middle */
+	_detector.setBeamCentre(width / 2, height / 2);
+	_detector.setDetectorSize(width, height);
+
+	if (!loadMatrix(matrixFile))
+	{
+		return false;
+	}
+
+	_crystal.populateMillers();
+	_detector.calculatePositions();
+
+	writePredictions(outputBase(matrixFile) + "_predictions.txt",
+	                 width, height);
+
+	return true;
+}
+
+void BatchPrediction::writeSweep(std::string filename, int width,
+                                 int height, double phiStart, double phiEnd,
+                                 vec3 axis)
+{
+	RotationSweep sweep(&_crystal, &_detector);
+	sweep.setAxis(axis);
+	sweep.setRange(phiStart, phiEnd);
+
+	std::vector<SweepPrediction> predictions;
+	sweep.predict(&predictions);
+
+	std::ofstream file;
+	file.open(filename.c_str());
+
+	vec3 beamCentre = _detector.getBeamCentre();
+	int count = 0;
+
+	file << "# h k l phi x y" << std::endl;
+
+	for (size_t i = 0; i < predictions.size(); i++)
+	{
+		SweepPrediction &p = predictions[i];
+		double x = p.x + beamCentre.x;
+		double y = p.y + beamCentre.y;
+
+		if (x < 0 || y < 0 || x >= width || y >= height)
+		{
+			continue;
+		}
+
+		file << p.h << " " << p.k << " " << p.l << " " << p.phi << " "
+		<< x << " " << y << std::endl;
+		count++;
+	}
+
+	file.close();
+
+	std::cout << "Wrote " << count << " sweep predictions to " << filename
+	<< std::endl;
+}
+
+bool BatchPrediction::predictSweep(std::string matrixFile, int width,
+                                   int height, double phiStart,
+                                   double phiEnd, vec3 axis)
+{
+	resetFrame();
+	_detector.setBeamCentre(width / 2, height / 2);
+	_detector.setDetectorSize(width, height);
+
+	if (!loadMatrix(matrixFile))
+	{
+		return false;
+	}
+
+	if (phiEnd <= phiStart || vec3_length(axis) <= 0)
+	{
+		std::cout << "Sweep for " << matrixFile << " needs phiEnd beyond "
+		"phiStart and a non-zero axis." << std::endl;
+		return false;
+	}
+
+	writeSweep(outputBase(matrixFile) + "_sweep.txt", width, height,
+	           phiStart, phiEnd, axis);
+
+	return true;
+}
+
+int BatchPrediction::run(std::string listFile)
+{
+	if (!file_exists(listFile))
+	{
+		std::cout << "Batch list " << listFile << " does not exist."
+		<< std::endl;
+		return 1;
+	}
+
+	std::string contents = get_file_contents(listFile);
+	std::vector<std::string> lines = split(contents, '\n');
+	int failures = 0;
+	int frames = 0;
+
+	for (size_t i = 0; i < lines.size(); i++)
+	{
+		std::string line = lines[i];
+		trim(line);
+
+		if (!line.length() || line[0] == '#')
+		{
+			continue;
+		}
+
+		std::vector<std::string> words = split(line, ' ');
+		std::vector<std::string> components;
+
+		for (size_t j = 0; j < words.size(); j++)
+		{
+			if (words[j].length()) components.push_back(words[j]);
+		}
+
+		if (components.size() < 3)
+		{
+			std::cout << "Batch line " << i + 1 << " should read "
+			"\"matrix.dat width height\", skipping." << std::endl;
+			failures++;
+			continue;
+		}
+
+		int width = atoi(components[1].c_str());
+		int height = atoi(components[2].c_str());
+		bool success = false;
+
+		if (components.size() >= 5)
+		{
+			double phiStart = atof(components[3].c_str());
+			double phiEnd = atof(components[4].c_str());
+			vec3 axis = make_vec3(1, 0, 0);
+
+			if (components.size() >= 8)
+			{
+				axis = make_vec3(atof(components[5].c_str()),
+				                 atof(components[6].c_str()),
+				                 atof(components[7].c_str()));
+			}
+
+			success = predictSweep(components[0], width, height,
+			                       phiStart, phiEnd, axis);
+		}
+		else
+		{
+			success = predictFrame(components[0], width, height);
+		}
+
+		if (!success)
+		{
+			failures++;
+		}
+
+		frames++;
+	}
+
+	std::cout << "Batch finished: " << frames << " frames, "
+	<< failures << " failures." << std::endl;
+
+	return (failures > 0);
+}
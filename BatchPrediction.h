@@ -0,0 +1,55 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __Windexing__BatchPrediction__
+#define __Windexing__BatchPrediction__
+
+#include <string>
+#include "Crystal.h"
+#include "Detector.h"
+
+/* Predicts spot lists for many saved matrix files without a GUI.
+ * The job list has one frame per line: matrix.dat width height
+ * Adding phiStart phiEnd [axisX axisY axisZ] predicts a rotation sweep
+ * about that spindle axis (default 1 0 0) instead of a still.
+ * A geometry file, if loaded, applies to every frame, sweeps included. */
+
+class BatchPrediction
+{
+public:
+	BatchPrediction();
+
+	int run(std::string listFile);
+	bool loadGeometry(std::string filename);
+	bool predictFrame(std::string matrixFile, int width, int height);
+	bool predictSweep(std::string matrixFile, int width, int height,
+	                  double phiStart, double phiEnd, vec3 axis);
+	bool loadMatrix(std::string filename);
+	void writePredictions(std::string filename, int width, int height);
+	void writeSweep(std::string filename, int width, int height,
+	                double phiStart, double phiEnd, vec3 axis);
+
+private:
+	void resetFrame();
+
+	Crystal _crystal;
+	Detector _detector;
+	PanelGeometry _geometry;
+};
+
+#endif
@@ -20,8 +20,9 @@
 #include "defaults.h"
 #include "mat3x3.h"
 #include <iostream>
-#include "Tinker.h"
-#include <QtCore/qcoreapplication.h>
+#include <algorithm>
+#include "ThreadPool.h"
+#include "RefinementLevenbergMarquardt.h"
 	
 
 vec3 Crystal::_cube[] = 
@@ -34,38 +35,58 @@ vec3 Crystal::_cube[] =
 {0.5, 0.5, -0.5},
 {0.5, 0.5, 0.5}};
 
-bool Crystal::isSysabs(int a, int b, int c)
+/* Bit (1 << type) is set for each centring in which this reflection is
+ * systematically absent; primitive lattices absent nothing. */
+static unsigned char absenceMask(int a, int b, int c)
 {
-    if (_latticeType == BravaisLatticePrimitive)
+    unsigned char mask = 0;
+
+    if (abs(a + b + c) % 2 != 0)
     {
-        return false;
+        mask |= (1 << BravaisLatticeBody);
     }
-    else if (_latticeType == BravaisLatticeBody)
+
+    if (abs(a + b) % 2 != 0 || abs(b + c) % 2 != 0 || abs(c + a) % 2 != 0)
     {
-        if (abs(a + b + c) % 2 != 0)
-        {
-            return true;
-        }
+        mask |= (1 << BravaisLatticeFace);
     }
-    else if (_latticeType == BravaisLatticeFace)
+
+    if (abs(a + b) % 2 == 1)
     {
-        if (abs(a + b) % 2 == 0 && abs(b + c) % 2 == 0
-            && abs(c + a) % 2 == 0)
-        {
-            return false;
-        }
-        
-        return true;
+        mask |= (1 << BravaisLatticeBase);
     }
-    else if (_latticeType == BravaisLatticeBase)
+
+    return mask;
+}
+
+static double masterLength(const MasterLattice &master, size_t i)
+{
+    vec3 abc = make_vec3(master.rx[i], master.ry[i], master.rz[i]);
+    return vec3_length(abc);
+}
+
+/* Number of master entries no longer than maxLength: as the master is
+ * sorted by length, these are the first ones. */
+static size_t masterPrefix(const MasterLattice &master, double maxLength)
+{
+    size_t lo = 0;
+    size_t hi = master.h.size();
+
+    while (lo < hi)
     {
-        if (abs(a + b) % 2 == 1)
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (masterLength(master, mid) <= maxLength)
+        {
+            lo = mid + 1;
+        }
+        else
         {
-            return true;
+            hi = mid;
         }
     }
-    
-    return false;
+
+    return lo;
 }
 
 Crystal::Crystal()
@@ -84,11 +105,22 @@ Crystal::Crystal()
     _rlpSize = 0.0015;
     _wavelength = STARTING_WAVELENGTH;
     _latticeType = BravaisLatticePrimitive;
+    _latticeValid = false;
+    _masterResolution = 0;
+    _selectionValid = false;
+    _shellValid = false;
+    _selectedRotation = make_mat3x3();
+    _shellGeneration = 0;
+    _watchGeneration = 0;
+    _detail = DetailFull;
+    _fillRow = 0;
 }
 
 void Crystal::setUnitCell(mat3x3 unitCell)
 {
 	_unitCell = unitCell;
+	_latticeValid = false;
+	_masterResolution = 0;
 	mat3x3 real = mat3x3_inverse(unitCell);
 	
 	mat3x3 trans = mat3x3_transpose(real);
@@ -116,136 +148,514 @@ void Crystal::setUnitCell(mat3x3 unitCell)
 void Crystal::setUnitCell(std::vector<double> cellDims)
 {
     _cellDims = cellDims;
+    _latticeValid = false;
+    _masterResolution = 0;
     mat3x3 mat = mat3x3_from_unit_cell(&cellDims[0]);
     _unitCell = mat3x3_inverse(mat);
-    
-    populateMillers();
 }
 
 void Crystal::quickCheckMillers()
 {
-/* duplicated code - work out best fix */
+    _shellValid = false;
+    flush();
+}
+
+/* Solves |p0 + l * c - centre|^2 = radius^2 for l, returning false if the
+ * line through this hkl column misses the sphere altogether. */
+static bool sphereColumnHits(vec3 p0, vec3 c, vec3 centre, double radius,
+                             double *lMin, double *lMax)
+{
+	vec3 diff = vec3_subtract_vec3(p0, centre);
+	double qa = vec3_sqlength(c);
+	double qb = vec3_dot_vec3(c, diff);
+	double qc = vec3_sqlength(diff) - radius * radius;
+	double disc = qb * qb - qa * qc;
+	
+	if (disc < 0 || qa <= 0)
+	{
+		return false;
+	}
+	
+	disc = sqrt(disc);
+	*lMin = (-qb - disc) / qa;
+	*lMax = (-qb + disc) / qa;
+	
+	return true;
+}
 
-    std::cout << "Checking " << _reflections.size() << " stored Millers." << std::endl;
+void Crystal::populateMillers()
+{
+    _selectionValid = false;
+    flush();
+    
+    std::cout << "Found " << _reflections.size() << " reflections." << std::endl;
+}
 
-    vec3 samplePos = make_vec3(0, 0, - 1 / _wavelength);
-    double minLength = 1 / _wavelength - _rlpSize;
-    double maxLength = 1 / _wavelength + _rlpSize;
-    double minLengthSq = minLength * minLength;
-    double maxLengthSq = maxLength * maxLength;
+/* Angle of the rotation taking the selection's orientation to the
+ * current one. */
+static double rotationBetween(mat3x3 &from, mat3x3 &to)
+{
+    mat3x3 inverse = mat3x3_transpose(from);
+    mat3x3 diff = mat3x3_mult_mat3x3(to, inverse);
+    double cosine = (diff.vals[0] + diff.vals[4] + diff.vals[8] - 1) / 2;
+    cosine = std::max(-1., std::min(1., cosine));
     
-	mat3x3 three = getNudge(_horiz, _vert, 0);
+    return acos(cosine);
+}
 
-    for (unsigned int i = 0; i < _reflections.size(); i++)
+void Crystal::flush()
+{
+    if (!_latticeValid)
     {
-		Reflection *refl = &(_reflections[i]);
-        vec3 abc = make_vec3(refl->h, refl->k, refl->l);
-
-		mat3x3_mult_vec(_unitCell, &abc);
-		mat3x3_mult_vec(_rotation, &abc);
-		mat3x3_mult_vec(three, &abc);
-        
-        vec3 diff = vec3_subtract_vec3(abc, samplePos);
-        
-        double sqLength = vec3_sqlength(diff);
+        _lattice = workingLattice(_resolution);
+        _coarseLattice.reset();
+        _latticeValid = true;
+        _selectionValid = false;
+    }
+    
+    /* Reflections are picked from within three rlp sizes of the sphere
+     * but shown within one, so the selection holds until the outermost
+     * point has turned through two rlp sizes. The nudge turns the
+     * crystal as much as the rotation does. */
+    bool coarse = (_detail == DetailCoarse);
+    double allowed = 2 * _rlpSize * (coarse ? COARSE_RESOLUTION : _resolution);
+    mat3x3 nudged = mat3x3_mult_mat3x3(getNudge(_horiz, _vert, 0), _rotation);
+    
+    if (_selectionValid &&
+        rotationBetween(_selectedRotation, nudged) > allowed)
+    {
+        _selectionValid = false;
+    }
+    
+    if (!_selectionValid)
+    {
+        std::cout << "Selecting reflections near the shell" << std::endl;
+        /* Watched reflections are held by Miller index, so a pick
+         * carries over to the new selection */
+        _reflections.clearRows();
+        _watchGeneration++;
+        _selectedRotation = nudged;
         
-        if (sqLength < minLengthSq || sqLength > maxLengthSq)
+        if (_detail == DetailFull)
         {
-			refl->onImage = false;
-            continue;
+            selectNearShell(*_lattice, 0, _lattice->grid.rowCount(), 0);
         }
-        
-        double length = sqrt(sqLength);
-        double size = fabs(1 / _wavelength - length) / (_rlpSize);
-        if (size < 0) size = 0;
-        if (size > 1) size = 1;
-		refl->onImage = true;
-		refl->weight = size;
-		refl->miller = abc;
+        else
+        {
+            /* Any fill-in under way was for the old orientation */
+            buildCoarseLattice();
+            selectNearShell(*_coarseLattice, 0,
+                            _coarseLattice->grid.rowCount(), 0);
+            _fillRow = 0;
+        }
+
+        _reflections.rewatchRows(0, _reflections.size());
+        _selectionValid = true;
+        _shellValid = false;
+    }
+    
+    if (!_shellValid)
+    {
+        checkShell(0, _reflections.size());
+        _shellValid = true;
     }
 }
 
-void Crystal::populateMillers()
+void Crystal::checkShell(size_t first, size_t last)
+{
+    /* Stored coordinates already include the unit cell */
+    mat3x3 three = getNudge(_horiz, _vert, 0);
+    mat3x3 transform = mat3x3_mult_mat3x3(three, _rotation);
+
+    ThreadPool::pool()->parallelFor(last - first, 16384,
+    [&](size_t start, size_t end, int)
+    {
+        _reflections.checkShell(transform, _wavelength, _rlpSize,
+                                first + start, first + end);
+    });
+    
+    _shellGeneration++;
+}
+
+void Crystal::buildCoarseLattice()
+{
+    if (_coarseLattice)
+    {
+        return;
+    }
+    
+    _coarseLattice = workingLattice(COARSE_RESOLUTION);
+}
+
+void Crystal::beginInteraction()
+{
+    if (_resolution >= COARSE_RESOLUTION || _detail == DetailCoarse)
+    {
+        return;
+    }
+    
+    /* Watched reflections beyond COARSE_RESOLUTION would vanish from
+     * the picture, so full detail is kept while any are watched */
+    if (_reflections.watchedCount() > 0)
+    {
+        return;
+    }
+    
+    _detail = DetailCoarse;
+    _selectionValid = false;
+}
+
+void Crystal::endInteraction()
+{
+    if (_detail == DetailCoarse)
+    {
+        _detail = DetailFilling;
+        _fillRow = 0;
+    }
+}
+
+/* Adds the reflections beyond COARSE_RESOLUTION from the next slice of
+ * grid rows, so that each call costs a fraction of a full selection. */
+bool Crystal::fillInSlice()
+{
+    if (_detail != DetailFilling)
+    {
+        return true;
+    }
+    
+    flush();
+    
+    size_t rows = _lattice->grid.rowCount();
+    size_t step = rows / FILL_IN_SLICES + 1;
+    size_t end = std::min(rows, _fillRow + step);
+    size_t before = _reflections.size();
+    
+    /* the coarse selection already has the start of the master */
+    size_t coarse = masterPrefix(*_lattice->master, 1 / COARSE_RESOLUTION);
+    selectNearShell(*_lattice, _fillRow, end, coarse);
+    _reflections.rewatchRows(before, _reflections.size());
+    checkShell(before, _reflections.size());
+    _fillRow = end;
+    
+    if (_fillRow >= rows)
+    {
+        _detail = DetailFull;
+    }
+    
+    return (_detail == DetailFull);
+}
+
+void Crystal::selectNearShell(const WorkingLattice &lattice, size_t rowStart,
+                              size_t rowEnd, size_t skipBelow)
 {
-    std::cout << "Populating millers" << std::endl;
-    _reflections.clear();
-    int aMax = _cellDims[0] / _resolution;
-    int bMax = _cellDims[1] / _resolution;
-    int cMax = _cellDims[2] / _resolution;
-    vec3 samplePos = make_vec3(0, 0, - 1 / _wavelength);
-    double minLength = 1 / _wavelength - _rlpSize;
-    double maxLength = 1 / _wavelength + _rlpSize;
-    double minLengthSq = minLength * minLength;
-    double maxLengthSq = maxLength * maxLength;
-    maxLength += _rlpSize * 2;
-    minLength -= _rlpSize * 2;
-    double minBuffer = minLength * minLength;
-    double maxBuffer = maxLength * maxLength; 
-
-    std::cout << minLengthSq << " " << maxLengthSq << std::endl;
-    std::cout << "To maximum resolution: " << _resolution << std::endl;
-    
-    for (int a = -aMax; a <= aMax; a++)
-    {
-        for (int b = -bMax; b <= bMax; b++)
+    double minLength = 1 / _wavelength - _rlpSize * 3;
+    double maxLength = 1 / _wavelength + _rlpSize * 3;
+    double minSq = minLength * minLength;
+    double maxSq = maxLength * maxLength;
+    double sampleZ = - 1 / _wavelength;
+    const double *m = _selectedRotation.vals;
+
+    /* Only the orientation has changed since the lattice was cached, so
+     * bring the shell back into the lattice's frame and only visit the
+     * grid cells it passes through. The rotation is orthonormal, so its
+     * transpose is its inverse. Chunks joined in order give the same
+     * list as a single thread would. */
+    vec3 centre = make_vec3(0, 0, sampleZ);
+    mat3x3 inverse = mat3x3_transpose(_selectedRotation);
+    mat3x3_mult_vec(inverse, &centre);
+
+    const MasterLattice &master = *lattice.master;
+    const LatticeGrid &grid = lattice.grid;
+    const size_t *entries = grid.entries().data();
+    ThreadPool *pool = ThreadPool::pool();
+    size_t rows = rowEnd - rowStart;
+    std::vector<ReflectionTable> chunks(pool->chunkCount(rows, 4));
+    
+    pool->parallelFor(rows, 4, [&](size_t start, size_t end, int chunk)
+    {
+        std::vector<size_t> ranges;
+        grid.shellRanges(centre, minLength, maxLength,
+                         rowStart + start, rowStart + end, &ranges);
+
+        for (size_t r = 0; r < ranges.size(); r += 2)
         {
-            for (int c = -cMax; c <= cMax; c++)
+            for (size_t j = ranges[r]; j < ranges[r + 1]; j++)
             {
-                vec3 abc = make_vec3(a, b, c);
-                
-                bool sysabs = isSysabs(a, b, c);
-               
-                if (sysabs) continue;
-
-                mat3x3_mult_vec(_unitCell, &abc);
-				double length = vec3_length(abc);
-
-				if (length > 1 / _resolution)
-				{
-					continue;
-				}
-
-                mat3x3_mult_vec(_rotation, &abc);
-                
-                vec3 diff = vec3_subtract_vec3(abc, samplePos);
-                
-                double sqLength = vec3_sqlength(diff);
-
-                if (sqLength < minBuffer || sqLength > maxBuffer)
+                size_t i = entries[j];
+
+                if (i < skipBelow)
                 {
-					continue;
+                    continue;
                 }
 
-				Reflection refl;
-				refl.miller = abc;
-				refl.h = a;
-				refl.k = b;
-				refl.l = c;
-				refl.weight = 0;
-				refl.onImage = false;
-				refl.watched = false;
-				_reflections.push_back(refl);
-			}
+                double a = master.rx[i];
+                double b = master.ry[i];
+                double c = master.rz[i];
+
+                double xx = m[0] * a + m[1] * b + m[2] * c;
+                double yy = m[3] * a + m[4] * b + m[5] * c;
+                double dz = m[6] * a + m[7] * b + m[8] * c - sampleZ;
+                double sqLength = xx * xx + yy * yy + dz * dz;
+
+                if (sqLength < minSq || sqLength > maxSq)
+                {
+                    continue;
+                }
+
+                chunks[chunk].add(master.h[i], master.k[i], master.l[i],
+                                  make_vec3(a, b, c));
+            }
+        }
+    });
+    
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        _reflections.append(chunks[i]);
+    }
+}
+
+/* Calls visit(b, l, abc) for every reflection in row a within maxLength
+ * of the origin, abc being its reciprocal coordinates. */
+template <typename Visit>
+static void visitMasterRow(mat3x3 &unitCell, int a, int bMax, int cMax,
+                           double maxLength, Visit visit)
+{
+    vec3 origin = make_vec3(0, 0, 0);
+
+    for (int b = -bMax; b <= bMax; b++)
+    {
+        vec3 p0 = make_vec3(a, b, 0);
+        vec3 c = make_vec3(0, 0, 1);
+        mat3x3_mult_vec(unitCell, &p0);
+        mat3x3_mult_vec(unitCell, &c);
+        double lMin, lMax;
+
+        if (!sphereColumnHits(p0, c, origin, maxLength, &lMin, &lMax))
+        {
+            continue;
+        }
+
+        int cStart = std::max((int)floor(lMin), -cMax);
+        int cEnd = std::min((int)ceil(lMax), cMax);
+
+        for (int l = cStart; l <= cEnd; l++)
+        {
+            vec3 abc = make_vec3(a, b, l);
+            mat3x3_mult_vec(unitCell, &abc);
+
+            if (vec3_length(abc) > maxLength)
+            {
+                continue;
+            }
+
+            visit(b, l, abc);
         }
     }
+}
+
+void Crystal::populateMaster()
+{
+    std::cout << "Enumerating lattice to " << _resolution << " A." << std::endl;
+
+    /* h, k and l are the rows of the inverse applied to the reciprocal
+     * vector, so each is bounded by its row length over the resolution;
+     * the cell edges alone fall short for oblique cells. */
+    mat3x3 toMiller = mat3x3_inverse(_unitCell);
+    int maxes[3];
+
+    for (int i = 0; i < 3; i++)
+    {
+        vec3 row = make_vec3(toMiller.vals[i * 3], toMiller.vals[i * 3 + 1],
+                             toMiller.vals[i * 3 + 2]);
+        maxes[i] = vec3_length(row) / _resolution;
+    }
+
+    int aMax = maxes[0];
+    int bMax = maxes[1];
+    int cMax = maxes[2];
+    double maxLength = 1 / _resolution;
+    mat3x3 unitCell = _unitCell;
     
-    quickCheckMillers();
+    /* The rows of a are counted first, so that the second pass writes
+     * each straight into its place in the master. */
+    ThreadPool *pool = ThreadPool::pool();
+    size_t rows = aMax * 2 + 1;
+    std::vector<size_t> rowStart(rows + 1, 0);
     
-    std::cout << "Found " << _reflections.size() << " reflections." << std::endl;
+    pool->parallelFor(rows, 4, [&](size_t start, size_t end, int)
+    {
+        for (size_t r = start; r < end; r++)
+        {
+            visitMasterRow(unitCell, (int)r - aMax, bMax, cMax, maxLength,
+                           [&](int, int, vec3) { rowStart[r + 1]++; });
+        }
+    });
+    
+    for (size_t r = 0; r < rows; r++)
+    {
+        rowStart[r + 1] += rowStart[r];
+    }
+    
+    size_t count = rowStart[rows];
+    MasterLatticePtr master = MasterLatticePtr(new MasterLattice());
+    MasterLattice &m = *master;
+    m.h.resize(count); m.k.resize(count); m.l.resize(count);
+    m.rx.resize(count); m.ry.resize(count); m.rz.resize(count);
+    
+    pool->parallelFor(rows, 4, [&](size_t start, size_t end, int)
+    {
+        for (size_t r = start; r < end; r++)
+        {
+            int a = (int)r - aMax;
+            size_t i = rowStart[r];
+            
+            visitMasterRow(unitCell, a, bMax, cMax, maxLength,
+                           [&](int b, int l, vec3 abc)
+            {
+                m.h[i] = a; m.k[i] = b; m.l[i] = l;
+                m.rx[i] = abc.x; m.ry[i] = abc.y; m.rz[i] = abc.z;
+                i++;
+            });
+        }
+    });
+    
+    /* Sort by length through an index, then carry out the permutation
+     * in place one cycle at a time, so no second copy is ever made. */
+    std::vector<size_t> order(count);
+    
+    {
+        std::vector<double> lengths(count);
+        
+        for (size_t i = 0; i < count; i++)
+        {
+            lengths[i] = masterLength(m, i);
+            order[i] = i;
+        }
+        
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+        {
+            return (lengths[a] < lengths[b] ||
+                    (lengths[a] == lengths[b] && a < b));
+        });
+    }
+    
+    for (size_t i = 0; i < count; i++)
+    {
+        if (order[i] == i)
+        {
+            continue;
+        }
+        
+        int h = m.h[i], k = m.k[i], l = m.l[i];
+        double x = m.rx[i], y = m.ry[i], z = m.rz[i];
+        size_t j = i;
+        
+        while (order[j] != i)
+        {
+            size_t from = order[j];
+            m.h[j] = m.h[from]; m.k[j] = m.k[from]; m.l[j] = m.l[from];
+            m.rx[j] = m.rx[from]; m.ry[j] = m.ry[from]; m.rz[j] = m.rz[from];
+            order[j] = j;
+            j = from;
+        }
+        
+        m.h[j] = h; m.k[j] = k; m.l[j] = l;
+        m.rx[j] = x; m.ry[j] = y; m.rz[j] = z;
+        order[j] = j;
+    }
+    
+    m.absent.resize(count);
+    
+    for (size_t i = 0; i < count; i++)
+    {
+        m.absent[i] = absenceMask(m.h[i], m.k[i], m.l[i]);
+    }
+    
+    _master = master;
+    _masterResolution = _resolution;
+}
+
+/* The master is sorted by length, so a resolution limit is a prefix of
+ * it and the centring a mask on each entry. */
+WorkingLatticePtr Crystal::workingLattice(double resolution)
+{
+    if (_masterResolution <= 0 || _resolution < _masterResolution)
+    {
+        populateMaster();
+    }
+    
+    const MasterLattice &master = *_master;
+    size_t count = masterPrefix(master, 1 / resolution);
+    
+    WorkingLatticePtr lattice = WorkingLatticePtr(new WorkingLattice());
+    lattice->master = _master;
+    lattice->grid.build(master.rx.data(), master.ry.data(),
+                        master.rz.data(), master.absent.data(),
+                        (1 << _latticeType), count, 1 / resolution,
+                        shellThickness());
+    
+    return lattice;
+}
+
+void Crystal::populateLattice(ReflectionTable *table)
+{
+    table->clear();
+    
+    if (_masterResolution <= 0 || _resolution < _masterResolution)
+    {
+        populateMaster();
+    }
+    
+    const MasterLattice &master = *_master;
+    size_t count = masterPrefix(master, 1 / _resolution);
+    unsigned char absent = (1 << _latticeType);
+    
+    ThreadPool *pool = ThreadPool::pool();
+    std::vector<ReflectionTable> chunks(pool->chunkCount(count, 16384));
+    
+    pool->parallelFor(count, 16384, [&](size_t start, size_t end, int chunk)
+    {
+        ReflectionTable *part = &chunks[chunk];
+        
+        for (size_t i = start; i < end; i++)
+        {
+            if (master.absent[i] & absent)
+            {
+                continue;
+            }
+            
+            part->add(master.h[i], master.k[i], master.l[i],
+                      make_vec3(master.rx[i], master.ry[i], master.rz[i]));
+        }
+    });
+    
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        table->append(chunks[i]);
+    }
 }
 
-mat3x3 Crystal::getNudge(double diffX, double diffY, double diffZ)
+void Crystal::nudgeAxes(vec3 *xAxis, vec3 *yAxis) const
 {
-    vec3 xAxis = {1, 0, 0};
-    vec3 yAxis = {0, 1, 0};
     vec3 zAxis = {0, 0, 1};
+    *xAxis = make_vec3(1, 0, 0);
+    *yAxis = make_vec3(0, 1, 0);
+    
+    vec3 fixedAxis = _fixedAxis;
     
-    if (vec3_length(_fixedAxis) > 0.5)
+    if (vec3_length(fixedAxis) > 0.5)
     {
-        xAxis = _fixedAxis;
-        yAxis = vec3_cross_vec3(_fixedAxis, zAxis);
-        vec3_set_length(&yAxis, 1);
+        *xAxis = fixedAxis;
+        *yAxis = vec3_cross_vec3(fixedAxis, zAxis);
+        vec3_set_length(yAxis, 1);
     }
+}
+
+mat3x3 Crystal::getNudge(double diffX, double diffY, double diffZ) const
+{
+    vec3 xAxis, yAxis;
+    vec3 zAxis = {0, 0, 1};
+    nudgeAxes(&xAxis, &yAxis);
     
     mat3x3 xRot = mat3x3_unit_vec_rotation(yAxis, diffX);
     mat3x3 yRot = mat3x3_unit_vec_rotation(xAxis, diffY);
@@ -262,8 +672,7 @@ void Crystal::applyRotation(double diffX, double diffY, double diffZ)
     mat3x3 three = getNudge(diffX, diffY, diffZ);
     
     _rotation = mat3x3_mult_mat3x3(three, _rotation);
-    
-    quickCheckMillers();
+    _shellValid = false;
     
     std::cout << mat3x3_desc(_rotation) << std::endl;
 }
@@ -306,7 +715,7 @@ void Crystal::bringAxisToScreen(std::vector<double> newAxis)
     
     std::cout << "Rotation: " << mat3x3_desc(_rotation) << std::endl;
     
-    populateMillers();
+    _selectionValid = false;
 }
 
 mat3x3 Crystal::getScaledBasisVectors()
@@ -319,41 +728,178 @@ mat3x3 Crystal::getScaledBasisVectors()
 
 bool Crystal::isBeingWatched(int i)
 {
-	return _reflections[i].watched;
+	return _reflections.hasFlag(i, ReflectionWatched);
 }
 
-double Crystal::ewaldSphereCloseness()
+/* Pure objective: no I/O, no drawing and nothing written back, so it can
+ * be called from any thread. */
+double Crystal::ewaldSphereCloseness() const
 {
-    quickCheckMillers();
-    
-    double sizeSum = 0;
-	int count = 0;
+	mat3x3 three = getNudge(_horiz, _vert, 0);
+	mat3x3 rotated = mat3x3_mult_mat3x3(three, _rotation);
+	mat3x3 transform = mat3x3_mult_mat3x3(rotated, _unitCell);
+	
+	return _reflections.watchedCloseness(transform, _wavelength, _rlpSize);
+}
 
-	for (unsigned int i = 0; i < _reflections.size(); i++)
-	{
-		if (!_reflections[i].watched)
-		{
-			continue;
-		}
+/* Vector from the centre of the Ewald sphere to watched reflection j,
+ * p - s with p = (vertical)(horizontal) R U hkl and s = (0, 0, -1 / l).
+ * Worked out from the Miller indices so that changes to the unit cell
+ * are seen. */
+vec3 Crystal::watchedDiff(size_t j, vec3 *beforeNudge, vec3 *afterHoriz) const
+{
+    vec3 xAxis, yAxis;
+    nudgeAxes(&xAxis, &yAxis);
+    
+    vec3 hkl = _reflections.watchedMiller(j);
+    mat3x3 toReciprocal = mat3x3_mult_mat3x3(_rotation, _unitCell);
+    vec3 p = mat3x3_mult_vec(toReciprocal, hkl);
+    *beforeNudge = p;
+    
+    mat3x3 horiz = mat3x3_unit_vec_rotation(yAxis, _horiz);
+    mat3x3 vert = mat3x3_unit_vec_rotation(xAxis, _vert);
+    p = mat3x3_mult_vec(horiz, p);
+    *afterHoriz = p;
+    p = mat3x3_mult_vec(vert, p);
+    p.z += 1 / _wavelength;
+    
+    return p;
+}
 
-		sizeSum += _reflections[i].weight;
-		count++;
-	}
+void Crystal::ewaldResiduals(std::vector<double> *residuals) const
+{
+    size_t count = _reflections.watchedCount();
+    residuals->resize(count);
+    vec3 before, middle;
+    
+    for (size_t j = 0; j < count; j++)
+    {
+        vec3 diff = watchedDiff(j, &before, &middle);
+        (*residuals)[j] = vec3_length(diff) - 1 / _wavelength;
+    }
+}
 
-	if (count == 0)
-	{
-		return 0;
-	}
+/* d/dt R(axis, t) v = axis x R(axis, t) v. The horizontal nudge is
+ * applied first, so its derivative also passes through the vertical. */
+void Crystal::nudgeDerivatives(bool horizontal,
+                               std::vector<double> *column) const
+{
+    size_t count = _reflections.watchedCount();
+    column->resize(count);
+    
+    vec3 xAxis, yAxis, before, middle;
+    nudgeAxes(&xAxis, &yAxis);
+    mat3x3 vert = mat3x3_unit_vec_rotation(xAxis, _vert);
+    
+    for (size_t j = 0; j < count; j++)
+    {
+        vec3 diff = watchedDiff(j, &before, &middle);
+        vec3_set_length(&diff, 1);
+        vec3 dp;
+        
+        if (horizontal)
+        {
+            dp = vec3_cross_vec3(yAxis, middle);
+            mat3x3_mult_vec(vert, &dp);
+        }
+        else
+        {
+            vec3 p = mat3x3_mult_vec(vert, middle);
+            dp = vec3_cross_vec3(xAxis, p);
+        }
+        
+        (*column)[j] = vec3_dot_vec3(diff, dp);
+    }
+}
 
-	sizeSum /= (double)count;
+/* The sphere centre moves with the wavelength as well as its radius:
+ * d/dl (|p - s| - 1 / l) = (1 - u_z) / l^2, u the unit vector p - s. */
+void Crystal::wavelengthDerivative(std::vector<double> *column) const
+{
+    size_t count = _reflections.watchedCount();
+    column->resize(count);
+    vec3 before, middle;
+    double invSq = 1 / (_wavelength * _wavelength);
+    
+    for (size_t j = 0; j < count; j++)
+    {
+        vec3 diff = watchedDiff(j, &before, &middle);
+        vec3_set_length(&diff, 1);
+        (*column)[j] = (1 - diff.z) * invSq;
+    }
+}
 
-    std::cout << "Ewald sphere closeness check " << sizeSum <<
-	" across " << count << " reflections." << std::endl;
+/* p = (N R) U hkl, so dp/dU_ab = (N R)_(:, a) hkl_b */
+void Crystal::unitCellDerivative(int element,
+                                 std::vector<double> *column) const
+{
+    size_t count = _reflections.watchedCount();
+    column->resize(count);
+    
+    int a = element / 3;
+    int b = element % 3;
+    mat3x3 nudged = mat3x3_mult_mat3x3(getNudge(_horiz, _vert, 0), _rotation);
+    vec3 axis = make_vec3(nudged.vals[a], nudged.vals[3 + a],
+                          nudged.vals[6 + a]);
+    vec3 before, middle;
+    
+    for (size_t j = 0; j < count; j++)
+    {
+        vec3 hkl = _reflections.watchedMiller(j);
+        double index = (b == 0 ? hkl.x : (b == 1 ? hkl.y : hkl.z));
+        
+        vec3 diff = watchedDiff(j, &before, &middle);
+        vec3_set_length(&diff, 1);
+        (*column)[j] = vec3_dot_vec3(diff, axis) * index;
+    }
+}
 
-    _tinker->drawPredictions();
-	QCoreApplication::processEvents();
+void Crystal::addEwaldParameters(RefinementLevenbergMarquardt *strategy,
+                                 bool unitCell, bool wavelength)
+{
+    strategy->setResidualFunction(ewaldSphereResiduals, this);
+    strategy->addDerivedParameter(this, getHorizontal, setHorizontal,
+                                  horizontalDerivatives, 0.002, 0.00001,
+                                  "horiz");
+    strategy->addDerivedParameter(this, getVertical, setVertical,
+                                  verticalDerivatives, 0.002, 0.00001,
+                                  "vert");
     
-	return sizeSum;
+    if (unitCell)
+    {
+        /* Only the upper triangle: the zeros below the diagonal fix the
+         * cell's orientation, which is otherwise degenerate with the
+         * rotation. */
+        double step = fabs(_unitCell.vals[0]) * 0.001;
+        double conv = step * 0.001;
+        
+        strategy->addDerivedParameter(this, getUnitCellElement<0>,
+                                      setUnitCellElement<0>,
+                                      unitCellDerivatives<0>, step, conv, "u0");
+        strategy->addDerivedParameter(this, getUnitCellElement<1>,
+                                      setUnitCellElement<1>,
+                                      unitCellDerivatives<1>, step, conv, "u1");
+        strategy->addDerivedParameter(this, getUnitCellElement<2>,
+                                      setUnitCellElement<2>,
+                                      unitCellDerivatives<2>, step, conv, "u2");
+        strategy->addDerivedParameter(this, getUnitCellElement<4>,
+                                      setUnitCellElement<4>,
+                                      unitCellDerivatives<4>, step, conv, "u4");
+        strategy->addDerivedParameter(this, getUnitCellElement<5>,
+                                      setUnitCellElement<5>,
+                                      unitCellDerivatives<5>, step, conv, "u5");
+        strategy->addDerivedParameter(this, getUnitCellElement<8>,
+                                      setUnitCellElement<8>,
+                                      unitCellDerivatives<8>, step, conv, "u8");
+    }
+    
+    if (wavelength)
+    {
+        strategy->addDerivedParameter(this, getWavelength, setWavelength,
+                                      wavelengthDerivatives,
+                                      _wavelength * 0.001,
+                                      _wavelength * 0.000001, "wavelength");
+    }
 }
 
 void Crystal::clearUpRefinement()
@@ -362,9 +908,7 @@ void Crystal::clearUpRefinement()
     _rotation = mat3x3_mult_mat3x3(three, _rotation);
     _horiz = 0;
     _vert = 0;
+    _shellValid = false;
 
-	for (unsigned int i = 0; i < _reflections.size(); i++)
-	{
-		_reflections[i].watched = false;
-	}
+	clearWatched();
 }
@@ -21,23 +21,46 @@
 #include "mat3x3.h"
 #include <iostream>
 #include "shared_ptrs.h"
+#include "ReflectionTable.h"
+#include "LatticeGrid.h"
 
-#define STARTING_WAVELENGTH 1.000
-#define STARTING_DISTANCE 500.000
+class RefinementLevenbergMarquardt;
+
+/* Every reflection to the finest resolution asked for with this cell,
+ * in order of length, with a bit (1 << BravaisLatticeType) set for each
+ * centring which makes it absent. Only the Miller indices and the
+ * unrotated reciprocal coordinates are kept, as it can be very large. */
+typedef struct
+{
+	std::vector<int> h, k, l;
+	std::vector<double> rx, ry, rz;
+	std::vector<unsigned char> absent;
+} MasterLattice;
 
+typedef boost::shared_ptr<MasterLattice> MasterLatticePtr;
+
+/* Every allowed reflection within a resolution limit: the grid holds
+ * the indices of those master entries, so that a change of resolution
+ * or centring builds a new index but never copies the entries. */
 typedef struct
 {
-	vec3 miller; // the transformed coordinates in reciprocal space
-	vec3 position; // updated by detector when needed
-	int h;
-	int k;
-	int l; // before transformation on a integer grid
-	double weight; // proportional to closeness to Ewald sphere
-	bool onImage; // whether it is to be displayed on overlay
-	bool watched;
-} Reflection;
-
-class Tinker;
+	MasterLatticePtr master;
+	LatticeGrid grid;
+} WorkingLattice;
+
+typedef enum
+{
+	DetailFull,
+	DetailCoarse,
+	DetailFilling,
+} DetailLevel;
+
+typedef boost::shared_ptr<WorkingLattice> WorkingLatticePtr;
+
+#define STARTING_WAVELENGTH 1.000
+#define STARTING_DISTANCE 500.000
+#define COARSE_RESOLUTION 4.0
+#define FILL_IN_SLICES 8
 
 class Crystal
 {
@@ -49,26 +72,71 @@ public:
     
     void applyRotation(double diffX, double diffY, double diffZ);
     mat3x3 getScaledBasisVectors();
-    mat3x3 getNudge(double diffX, double diffY, double diffZ);
+    mat3x3 getNudge(double diffX, double diffY, double diffZ) const;
     void clearUpRefinement();
     bool isBeingWatched(int i);
     void quickCheckMillers();
     void populateMillers();
+
+    /* Brings the lattice, the reflections near the shell and their
+     * rotated positions up to date, redoing only the stages which a
+     * setter has made stale since the last flush. */
+    void flush();
+
+    /* Bumped whenever rotated positions or shell membership change,
+     * and whenever the watched set changes, for anything downstream
+     * deciding whether to redo its own work. */
+    unsigned long shellGeneration()
+    {
+        return _shellGeneration;
+    }
+
+    unsigned long watchGeneration()
+    {
+        return _watchGeneration;
+    }
+
+    /* While the user is turning the crystal, only reflections to
+     * COARSE_RESOLUTION are picked. Once they stop, fillInSlice adds the
+     * rest a slice of the lattice at a time, returning true when the
+     * picture is complete; turning again abandons the fill-in. Full
+     * detail is kept throughout while any reflection is watched. */
+    void beginInteraction();
+    void endInteraction();
+    bool fillInSlice();
+
+    /* Every allowed reflection within the resolution limit regardless of
+     * orientation, unrotated, in the same order on any thread count. */
+    void populateLattice(ReflectionTable *table);
     
 
     static double ewaldSphereClosenessScore(void *crystal)
     {
         return static_cast<Crystal *>(crystal)->ewaldSphereCloseness();
     }
+
+    /* For strategies which evaluate on private copies from several
+     * threads at once */
+    static void *cloneCrystal(void *crystal)
+    {
+        return new Crystal(*static_cast<Crystal *>(crystal));
+    }
+
+    static void deleteCrystal(void *crystal)
+    {
+        delete static_cast<Crystal *>(crystal);
+    }
    
     static void setHorizontal(void *crystal, double horiz)
     {
         static_cast<Crystal *>(crystal)->_horiz = horiz;
+        static_cast<Crystal *>(crystal)->_shellValid = false;
     }
     
     static void setVertical(void *crystal, double vert)
     {
         static_cast<Crystal *>(crystal)->_vert = vert;
+        static_cast<Crystal *>(crystal)->_shellValid = false;
     }
     
     static double getVertical(void *crystal)
@@ -80,16 +148,80 @@ public:
     {
         return static_cast<Crystal *>(crystal)->_horiz;
     }
+
+    static double getWavelength(void *crystal)
+    {
+        return static_cast<Crystal *>(crystal)->_wavelength;
+    }
+
+    static void setWavelength(void *crystal, double wavelength)
+    {
+        static_cast<Crystal *>(crystal)->_wavelength = wavelength;
+        static_cast<Crystal *>(crystal)->_selectionValid = false;
+    }
+
+    /* Element N of the matrix taking Miller indices to reciprocal space */
+    template <int N>
+    static double getUnitCellElement(void *crystal)
+    {
+        return static_cast<Crystal *>(crystal)->_unitCell.vals[N];
+    }
+
+    template <int N>
+    static void setUnitCellElement(void *crystal, double value)
+    {
+        static_cast<Crystal *>(crystal)->_unitCell.vals[N] = value;
+        static_cast<Crystal *>(crystal)->_latticeValid = false;
+        static_cast<Crystal *>(crystal)->_masterResolution = 0;
+    }
+
+    /* Signed distance of each watched reflection from the Ewald sphere,
+     * and its analytic derivatives, for least-squares refinement. */
+    static void ewaldSphereResiduals(void *crystal,
+                                     std::vector<double> *residuals)
+    {
+        static_cast<Crystal *>(crystal)->ewaldResiduals(residuals);
+    }
+
+    static void horizontalDerivatives(void *crystal,
+                                      std::vector<double> *column)
+    {
+        static_cast<Crystal *>(crystal)->nudgeDerivatives(true, column);
+    }
+
+    static void verticalDerivatives(void *crystal,
+                                    std::vector<double> *column)
+    {
+        static_cast<Crystal *>(crystal)->nudgeDerivatives(false, column);
+    }
+
+    static void wavelengthDerivatives(void *crystal,
+                                      std::vector<double> *column)
+    {
+        static_cast<Crystal *>(crystal)->wavelengthDerivative(column);
+    }
+
+    template <int N>
+    static void unitCellDerivatives(void *crystal,
+                                    std::vector<double> *column)
+    {
+        static_cast<Crystal *>(crystal)->unitCellDerivative(N, column);
+    }
+
+    /* Adds the nudge angles, and optionally the upper triangle of the
+     * unit cell matrix and the wavelength. Scaling the cell and
+     * 1 / wavelength together leaves every residual unchanged, so
+     * refining both at once leaves them undetermined; and as every
+     * reflection near the origin lies close to the sphere, the cell
+     * alone needs well spread, accurate spots. */
+    void addEwaldParameters(RefinementLevenbergMarquardt *strategy,
+                            bool unitCell, bool wavelength);
     
     
     void setResolution(double resolution)
     {
         _resolution = resolution;
-    }
-    
-    Reflection *refl(int i)
-    {
-        return &_reflections[i];
+        _latticeValid = false;
     }
     
     size_t millerCount()
@@ -100,40 +232,43 @@ public:
     vec3 miller(int i)
     {
         //Transformed into reciprocal space. Already fractional.
-        return _reflections[i].miller;
+        return make_vec3(_reflections.x[i], _reflections.y[i],
+                         _reflections.z[i]);
     }
 
-	void setPositionForMiller(int i, vec3 pos)
-	{
-		_reflections[i].position = pos;
-	}
-
-	vec3 position(int i)
+	void toggleWatched(int i)
 	{
-		return _reflections[i].position;
+		_reflections.toggleWatched(i);
+		_watchGeneration++;
 	}
 
-	void toggleWatched(int i)
+	void clearWatched()
 	{
-		_reflections[i].watched = ((_reflections[i].watched == 0) ? 1 : 0);
+		_reflections.clearWatched();
+		_watchGeneration++;
 	}
     
     void getMillerHKL(int i, int *h, int *k, int *l)
     {
-        *h = _reflections[i].h;
-        *k = _reflections[i].k;
-        *l = _reflections[i].l;
+        *h = _reflections.h[i];
+        *k = _reflections.k[i];
+        *l = _reflections.l[i];
     }
     
 
     double weightForMiller(int i)
     {
-        return _reflections[i].weight;
+        return _reflections.weight[i];
     }
 
 	bool shouldDisplayMiller(int i)
 	{
-		return _reflections[i].onImage;
+		return _reflections.hasFlag(i, ReflectionOnImage);
+	}
+
+	ReflectionTable *reflectionTable()
+	{
+		return &_reflections;
 	}
     
     void setFixedAxis(vec3 axis)
@@ -149,6 +284,7 @@ public:
     void setWavelength(double wavelength)
     {
         _wavelength = wavelength;
+        _selectionValid = false;
     }
     
     double getRlpSize()
@@ -159,14 +295,10 @@ public:
     void setRlpSize(double rlpSize)
     {
         _rlpSize = rlpSize;
+        _selectionValid = false;
     }
     
     
-    void setTinker(Tinker *tinker)
-    {
-        _tinker = tinker;
-    }
-    
     mat3x3 getRotation()
     {
         return _rotation;
@@ -175,6 +307,7 @@ public:
     void setRotation(mat3x3 rot)
     {
         _rotation = rot;
+        _shellValid = false;
     }
     
     mat3x3 getUnitCell()
@@ -187,18 +320,57 @@ public:
     void setBravaisLattice(BravaisLatticeType type)
     {
         _latticeType = type;
+        _latticeValid = false;
     }
 
 private:
-    double ewaldSphereCloseness();
-    bool isSysabs(int a, int b, int c);
-    Tinker *_tinker;
+    double ewaldSphereCloseness() const;
+    void nudgeAxes(vec3 *xAxis, vec3 *yAxis) const;
+    vec3 watchedDiff(size_t j, vec3 *beforeNudge, vec3 *afterHoriz) const;
+    void ewaldResiduals(std::vector<double> *residuals) const;
+    void nudgeDerivatives(bool horizontal, std::vector<double> *column) const;
+    void wavelengthDerivative(std::vector<double> *column) const;
+    void unitCellDerivative(int element, std::vector<double> *column) const;
+    void populateMaster();
+    WorkingLatticePtr workingLattice(double resolution);
+    void selectNearShell(const WorkingLattice &lattice, size_t rowStart,
+                         size_t rowEnd, size_t skipBelow);
+    void checkShell(size_t first, size_t last);
+    void buildCoarseLattice();
+
+    /* Reflections are selected within three rlp sizes either side of
+     * the sphere; the lattice grids use cells about this thick. */
+    double shellThickness() const
+    {
+        return _rlpSize * 6;
+    }
 
     std::vector<double> _cellDims;
     mat3x3 _rotation;
     mat3x3 _unitCell;
 
-	std::vector<Reflection> _reflections;
+	ReflectionTable _reflections;
+
+	/* Only a new cell, or a finer resolution, enumerates the master
+	 * again; the cell, lattice type and resolution invalidate the
+	 * working lattice. Both are replaced rather than changed, so copies
+	 * of the crystal (such as refinement clones) can share them. */
+	MasterLatticePtr _master;
+	double _masterResolution;
+	WorkingLatticePtr _lattice;
+	WorkingLatticePtr _coarseLattice;
+	bool _latticeValid;
+	DetailLevel _detail;
+	size_t _fillRow;
+
+	/* _reflections holds the lattice near the shell as it was at
+	 * _selectedRotation (the nudge included); its rotated positions and
+	 * flags are current when _shellValid is set. */
+	bool _selectionValid;
+	bool _shellValid;
+	mat3x3 _selectedRotation;
+	unsigned long _shellGeneration;
+	unsigned long _watchGeneration;
 
     double _resolution;
     double _rlpSize;
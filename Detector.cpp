@@ -21,147 +21,237 @@
 #include "defaults.h"
 #include <iostream>
 #include "float.h"
+#include <cmath>
+#include "ThreadPool.h"
 
 Detector::Detector()
 {
     _beamCentre = make_vec3(-1, -1, STARTING_DISTANCE);
     _wavelength = STARTING_WAVELENGTH;
-	_lookupTree = NULL;
+    _xtal = NULL;
+    _width = 0;
+    _height = 0;
+    _projectionValid = false;
+    _projectedShell = 0;
+    _generation = 0;
 }
 
-void Detector::calculatePositions()
+/* Branch-free so that it vectorises: keep[i] says whether reflection i
+ * is on the shell, in front of the sample and within the bounds. */
+VECTOR_KERNEL(project_cull_kernel,
+              (const double *__restrict x,
+               const double *__restrict y,
+               const double *__restrict z,
+               const unsigned char *__restrict flags,
+               size_t count, double sampleZ, double distance,
+               double minX, double maxX,
+               double minY, double maxY,
+               double *__restrict outX,
+               double *__restrict outY,
+               unsigned char *__restrict keep),
+              (x, y, z, flags, count, sampleZ, distance, minX,
+               maxX, minY, maxY, outX, outY, keep))
 {
-	vec3 samplePos = make_vec3(0, 0, - 1 / _wavelength);
-
-	for (size_t i = 0; i < _xtal->millerCount(); i++)
+	for (size_t i = 0; i < count; i++)
 	{
-		vec3 miller = _xtal->miller(i);
-
-		vec3 diff = vec3_subtract_vec3(miller, samplePos);
-		double mult = _beamCentre.z / diff.z;
-        vec3_mult(&diff, mult);
-        
-		_xtal->setPositionForMiller(i, diff);
-    }
-}
+		double dz = z[i] - sampleZ;
+		double mult = distance / dz;
+		double px = x[i] * mult;
+		double py = y[i] * mult;
 
-double Detector::distToMiller(int i, int x, int y)
-{
-	vec3 pos = _xtal->position(i);
-	vec3 clickPos = make_vec3(x, y, pos.z);
-	vec3 diff = vec3_subtract_vec3(clickPos, pos);
-	
-	return vec3_length(diff);
+		outX[i] = px;
+		outY[i] = py;
+		keep[i] = (dz > 0) & (px >= minX) & (px <= maxX) &
+		          (py >= minY) & (py <= maxY);
+	}
+
+	/* flags are bytes against doubles above; a loop of their own keeps
+	 * both vectorised */
+	for (size_t i = 0; i < count; i++)
+	{
+		keep[i] &= flags[i] & ReflectionOnImage;
+	}
 }
 
-bool Detector::nearMiller(int i, int x, int y)
+void Detector::calculatePositions()
 {
-	bool onImage = _xtal->shouldDisplayMiller(i);
-
-	if (!onImage) return false;
+	ReflectionTable *table = _xtal->reflectionTable();
+	size_t count = table->size();
+	double minX = -DBL_MAX, maxX = DBL_MAX;
+	double minY = -DBL_MAX, maxY = DBL_MAX;
 
-	vec3 pos = _xtal->position(i);
-
-	if (x >= pos.x - CLOSENESS && x <= pos.x + CLOSENESS &&
-	    y >= pos.y - CLOSENESS && y <= pos.y + CLOSENESS)
+	if (_width > 0 && _height > 0)
 	{
-		return true;
+		minX = -_beamCentre.x - DETECTOR_CULL_MARGIN;
+		maxX = _width - _beamCentre.x + DETECTOR_CULL_MARGIN;
+		minY = -_beamCentre.y - DETECTOR_CULL_MARGIN;
+		maxY = _height - _beamCentre.y + DETECTOR_CULL_MARGIN;
 	}
-	
-	return false;
-}
 
-int Detector::positionNearCoord(int x, int y)
-{
-	x -= _beamCentre.x;
-	y -= _beamCentre.y;
+	/* Chunks joined in order give the same list on any thread count */
+	ThreadPool *pool = ThreadPool::pool();
+	std::vector<std::vector<VisibleSpot> > chunks;
+	chunks.resize(pool->chunkCount(count, 16384));
 
-	if (!_lookupTree)
+	pool->parallelFor(count, 16384, [&](size_t start, size_t end, int chunk)
 	{
-		for (size_t i = 0; i < _xtal->millerCount(); i++)
+		size_t n = end - start;
+
+		/* an empty table still comes through as one empty chunk */
+		if (n == 0)
 		{
-			if (nearMiller(i, x, y))
-			{
-				return i;
-			}
+			return;
 		}
 
-		return -1;
-	}
-	
-	Node *node = _lookupTree;
-	int drills = 0;
-	
-	/* Some non-exit condition and I'm too lazy to fix properly */
-	int max_drills = 50;
+		std::vector<double> xs(n), ys(n);
+		std::vector<unsigned char> keep(n);
 
-	while (true && drills < max_drills)
-	{
-		for (int i = 0; i < 4; i++)
+		if (_panels.panelCount() > 0)
 		{
-			Node *trial = node->nextNodes[i];
+			_panels.locate(table->x.data() + start,
+			               table->y.data() + start,
+			               table->z.data() + start, n, - 1 / _wavelength,
+			               xs.data(), ys.data(), keep.data());
 
-			if (!trial)
+			/* panel pixels are absolute, spots are kept relative */
+			for (size_t i = 0; i < n; i++)
 			{
-				goto finished_node_search;
-			}	
+				keep[i] &= (table->flags[start + i] & ReflectionOnImage);
+				xs[i] -= _beamCentre.x;
+				ys[i] -= _beamCentre.y;
+			}
+		}
+		else
+		{
+			project_cull_kernel(table->x.data() + start,
+			                    table->y.data() + start,
+			                    table->z.data() + start,
+			                    table->flags.data() + start, n, - 1 / _wavelength,
+			                    _beamCentre.z, minX, maxX, minY, maxY,
+			                    xs.data(), ys.data(), keep.data());
+		}
+
+		std::vector<VisibleSpot> *part = &chunks[chunk];
 
-			if (x > trial->xMin && x < trial->xMax && 
-			    y > trial->yMin && y < trial->yMax)
+		for (size_t i = 0; i < n; i++)
+		{
+			if (!keep[i])
 			{
-				node = trial;
-				break;
+				continue;
 			}
+
+			VisibleSpot spot;
+			spot.index = start + i;
+			spot.x = xs[i];
+			spot.y = ys[i];
+			spot.weight = table->weight[start + i];
+			part->push_back(spot);
 		}
-		
-		drills++;
+	});
+
+	_visible.clear();
+
+	for (size_t i = 0; i < chunks.size(); i++)
+	{
+		_visible.insert(_visible.end(), chunks[i].begin(), chunks[i].end());
 	}
-	
-finished_node_search:
-	
-	std::cout << "Drilled down " << drills << " nodes." << std::endl;
-	
-	int best_n = -1;
-	double distance = FLT_MAX;
-	
-	for (size_t i = 0; i < node->nRefls; i++)
+
+	prepareLookupTable();
+
+	_projectionValid = true;
+	_projectedShell = _xtal->shellGeneration();
+	_generation++;
+}
+
+void Detector::locate(const double *x, const double *y, const double *z,
+                      size_t count, double *outX, double *outY,
+                      unsigned char *hit) const
+{
+	double sampleZ = - 1 / _wavelength;
+
+	if (_panels.panelCount() > 0)
 	{
-		int n = node->reflPtrs[i];
+		_panels.locate(x, y, z, count, sampleZ, outX, outY, hit);
 
-		if (nearMiller(n, x, y))
+		for (size_t i = 0; i < count; i++)
 		{
-			double thisDist = distToMiller(n, x, y);
-			
-			if (thisDist < distance)
-			{
-				distance = thisDist;
-				best_n = n;	
-			}
+			outX[i] -= _beamCentre.x;
+			outY[i] -= _beamCentre.y;
 		}
+
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		double dz = z[i] - sampleZ;
+		double mult = _beamCentre.z / dz;
+		outX[i] = x[i] * mult;
+		outY[i] = y[i] * mult;
+		hit[i] = (dz > 0);
 	}
-	
-	return best_n;
 }
 
-void Detector::prepareLookupTable()
+bool Detector::loadGeometry(std::string filename)
 {
-	delete_node(_lookupTree);
-	_lookupTree = NULL;
-	
-	size_t count = _xtal->millerCount();
-	if (!count) return;
+	PanelGeometry panels;
 
-	Reflection *start = _xtal->refl(0);
-	_lookupTree = make_node();
-	prepare_node(_lookupTree, start, count);
-	recursive_split_node(_lookupTree);
+	if (!panels.load(filename))
+	{
+		return false;
+	}
+
+	setGeometry(panels);
+
+	return true;
 }
 
-Detector::~Detector()
+void Detector::setGeometry(const PanelGeometry &panels)
+{
+	_panels = panels;
+	_projectionValid = false;
+}
+
+void Detector::clearGeometry()
+{
+	_panels.clear();
+	_projectionValid = false;
+}
+
+void Detector::flush()
 {
-	if (_lookupTree)
+	if (_projectionValid && _projectedShell == _xtal->shellGeneration())
 	{
-		delete_node(_lookupTree);
+		return;
 	}
+
+	calculatePositions();
 }
 
+int Detector::positionNearCoord(int x, int y)
+{
+	x -= _beamCentre.x;
+	y -= _beamCentre.y;
+
+	return _spotGrid.nearest(x, y);
+}
+
+void Detector::prepareLookupTable()
+{
+	std::vector<double> xs(_visible.size()), ys(_visible.size());
+	std::vector<int> refls(_visible.size());
+	
+	for (size_t i = 0; i < _visible.size(); i++)
+	{
+		xs[i] = _visible[i].x;
+		ys[i] = _visible[i].y;
+		refls[i] = _visible[i].index;
+	}
+	
+	_spotGrid.build(xs, ys, refls, CLOSENESS);
+}
+
+Detector::~Detector()
+{
+
+}
@@ -22,34 +22,94 @@
 #include "mat3x3.h"
 #include <vector>
 #include <iostream>
-#include "Node.h"
+#include "SpotGrid.h"
+#include "PanelGeometry.h"
+
+#define DETECTOR_CULL_MARGIN 10
 
 class Crystal;
 
+typedef struct
+{
+	int index; // into the crystal's reflections
+	double x, y; // relative to the beam centre, in pixels
+	double weight;
+} VisibleSpot;
+
 class Detector
 {
 public:
     Detector();
 	~Detector();
     
+    /* Projects the reflections on the shell in one pass, keeping only
+     * those landing within DETECTOR_CULL_MARGIN of the detector, or
+     * on a panel when a geometry file is loaded. */
     void calculatePositions();
+
+	/* Projects again only if the crystal's shell or the detector
+	 * geometry has changed since the last projection. */
+	void flush();
+
+	/* Panels from a CrystFEL-style geometry file replace the flat
+	 * detector: they fix where spots land in the image, so the beam
+	 * centre and detector distance no longer move the predictions. */
+	bool loadGeometry(std::string filename);
+	void setGeometry(const PanelGeometry &panels);
+	void clearGeometry();
+
+	bool hasPanels()
+	{
+		return _panels.panelCount() > 0;
+	}
+
+	/* Bumped whenever the visible spots change */
+	unsigned long generation()
+	{
+		return _generation;
+	}
     int positionNearCoord(int x, int y);
 	void prepareLookupTable();
 
+	/* Where the rays towards these rotated reciprocal lattice points
+	 * land, relative to the beam centre: on the panels if a geometry is
+	 * loaded, otherwise on the flat detector. hit[i] is 0 for rays that
+	 * miss every panel or head back towards the source. */
+	void locate(const double *x, const double *y, const double *z,
+	            size_t count, double *outX, double *outY,
+	            unsigned char *hit) const;
+
     vec3 getBeamCentre()
     {
         return _beamCentre;
     }
       
+    /* Spots are culled against the detector edges, which move with
+     * the beam centre. */
     void setBeamCentre(double x, double y)
     {
         _beamCentre.x = x;
         _beamCentre.y = y;
+        _projectionValid = false;
+    }
+
+    /* 0 leaves the detector unbounded */
+    void setDetectorSize(int width, int height)
+    {
+        _width = width;
+        _height = height;
+        _projectionValid = false;
+    }
+
+    const std::vector<VisibleSpot> &visibleSpots()
+    {
+        return _visible;
     }
     
     void setDetectorDistance(double z)
     {
         _beamCentre.z = z;
+        _projectionValid = false;
     }
     
     double getWavelength()
@@ -60,6 +120,7 @@ public:
     void setWavelength(double wavelength)
     {
         _wavelength = wavelength;
+        _projectionValid = false;
 	std::cout << "Setting wavelength to " << wavelength << std::endl;
     }
     
@@ -67,6 +128,7 @@ public:
     {
         _beamCentre.x += x;
         _beamCentre.y += y;
+        _projectionValid = false;
         std::cout << "New beam centre " << _beamCentre.x << " "
          << _beamCentre.y << std::endl;
     }
@@ -79,11 +141,15 @@ private:
 	Crystal *_xtal;
 	vec3 _beamCentre; // beam X, beam Y, det dist. all pix
 	double _wavelength;
-	std::vector<vec3> _positions;
-	bool nearMiller(int i, int x, int y);
-	double distToMiller(int i, int x, int y);
+	SpotGrid _spotGrid;
+	PanelGeometry _panels;
+	std::vector<VisibleSpot> _visible;
+	int _width;
+	int _height;
 
-	Node *_lookupTree;
+	bool _projectionValid;
+	unsigned long _projectedShell;
+	unsigned long _generation;
 };
 
 
@@ -0,0 +1,189 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "LatticeGrid.h"
+#include <math.h>
+#include <algorithm>
+
+LatticeGrid::LatticeGrid()
+{
+	clear();
+}
+
+void LatticeGrid::clear()
+{
+	_radius = 0;
+	_cellSize = 1;
+	_cells = 0;
+	_cellStart.clear();
+	_entries.clear();
+}
+
+void LatticeGrid::build(const double *rx, const double *ry,
+                        const double *rz, const unsigned char *absent,
+                        unsigned char skipBits, size_t count, double radius,
+                        double cellSize)
+{
+	clear();
+
+	if (count == 0 || radius <= 0 || cellSize <= 0)
+	{
+		return;
+	}
+
+	/* Cells as thick as the shell keep the cells a query visits close
+	 * to the shell itself; no more cells than points keeps the grid
+	 * smaller than the lattice. */
+	int most = std::max(1, (int)cbrt((double)count));
+	_radius = radius;
+	_cells = std::min(most, std::max(1, (int)ceil(radius * 2 / cellSize)));
+	_cellSize = radius * 2 / _cells;
+	_cellStart.resize((size_t)_cells * _cells * _cells + 1, 0);
+
+	/* Counting sort by cell, working each cell out again on the second
+	 * pass rather than holding on to it */
+	for (size_t i = 0; i < count; i++)
+	{
+		if (absent[i] & skipBits)
+		{
+			continue;
+		}
+
+		size_t cell = cellIndex(cellCoord(rx[i]), cellCoord(ry[i]),
+		                        cellCoord(rz[i]));
+		_cellStart[cell + 1]++;
+	}
+
+	for (size_t i = 1; i < _cellStart.size(); i++)
+	{
+		_cellStart[i] += _cellStart[i - 1];
+	}
+
+	_entries.resize(_cellStart.back());
+	std::vector<size_t> fill(_cellStart.begin(), _cellStart.end() - 1);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (absent[i] & skipBits)
+		{
+			continue;
+		}
+
+		size_t cell = cellIndex(cellCoord(rx[i]), cellCoord(ry[i]),
+		                        cellCoord(rz[i]));
+		_entries[fill[cell]++] = i;
+	}
+}
+
+/* Distances from value to the nearest and furthest points of [lo, hi] */
+static void spanDistances(double value, double lo, double hi,
+                          double *nearest, double *furthest)
+{
+	*nearest = 0;
+
+	if (value < lo)
+	{
+		*nearest = lo - value;
+	}
+	else if (value > hi)
+	{
+		*nearest = value - hi;
+	}
+
+	*furthest = std::max(fabs(value - lo), fabs(value - hi));
+}
+
+void LatticeGrid::shellRanges(vec3 centre,
+                              double minLength, double maxLength,
+                              size_t rowStart, size_t rowEnd,
+                              std::vector<size_t> *ranges) const
+{
+	double outerSq = maxLength * maxLength;
+	double innerSq = (minLength > 0) ? minLength * minLength : 0;
+
+	for (int cx = rowStart; cx < (int)rowEnd; cx++)
+	{
+		double x0 = -_radius + cx * _cellSize;
+		double nearX, farX;
+		spanDistances(centre.x, x0, x0 + _cellSize, &nearX, &farX);
+
+		if (nearX * nearX > outerSq)
+		{
+			continue;
+		}
+
+		/* only the columns of this slab within reach of the outer
+		 * sphere... */
+		double reachY = sqrt(outerSq - nearX * nearX);
+		int cyEnd = cellCoord(centre.y + reachY);
+
+		for (int cy = cellCoord(centre.y - reachY); cy <= cyEnd; cy++)
+		{
+			double y0 = -_radius + cy * _cellSize;
+			double nearY, farY;
+			spanDistances(centre.y, y0, y0 + _cellSize, &nearY, &farY);
+
+			double nearSq = nearX * nearX + nearY * nearY;
+
+			if (nearSq > outerSq)
+			{
+				continue;
+			}
+
+			/* ...and of each column only the cells the outer sphere
+			 * reaches... */
+			double half = sqrt(outerSq - nearSq);
+			int czStart = cellCoord(centre.z - half);
+			int czEnd = cellCoord(centre.z + half) + 1;
+
+			/* ...less any wholly inside the inner one */
+			double farSq = farX * farX + farY * farY;
+			int holeStart = czEnd;
+			int holeEnd = czEnd;
+
+			if (innerSq > farSq)
+			{
+				double inner = sqrt(innerSq - farSq);
+				double first = (centre.z - inner + _radius) / _cellSize;
+				double last = (centre.z + inner + _radius) / _cellSize;
+				holeStart = std::max(czStart, (int)ceil(first));
+				holeEnd = std::min(czEnd, (int)floor(last));
+
+				if (holeEnd <= holeStart)
+				{
+					holeStart = czEnd;
+					holeEnd = czEnd;
+				}
+			}
+
+			size_t column = cellIndex(cx, cy, 0);
+
+			if (holeStart > czStart)
+			{
+				ranges->push_back(_cellStart[column + czStart]);
+				ranges->push_back(_cellStart[column + holeStart]);
+			}
+
+			if (czEnd > holeEnd)
+			{
+				ranges->push_back(_cellStart[column + holeEnd]);
+				ranges->push_back(_cellStart[column + czEnd]);
+			}
+		}
+	}
+}
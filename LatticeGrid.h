@@ -0,0 +1,87 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __Windexing__LatticeGrid__
+#define __Windexing__LatticeGrid__
+
+#include <vector>
+#include <stddef.h>
+#include "mat3x3.h"
+
+/* Index over the unrotated reciprocal lattice: a uniform 3D grid of
+ * cells about as thick as the shell being looked for, holding the
+ * indices of the lattice points sorted by cell (x, then y, then z). The
+ * points themselves stay where they are. A shell query only visits the
+ * cells which cross it, and as the cells along z are consecutive, it
+ * returns at most two ranges of entries() per column of cells. */
+
+class LatticeGrid
+{
+public:
+	LatticeGrid();
+
+	void clear();
+
+	/* Indexes points 0 to count of rx, ry and rz, which must lie within
+	 * radius of the origin, leaving out those whose absent bits include
+	 * skipBits. Cells are cellSize across, unless that would give more
+	 * cells than points. */
+	void build(const double *rx, const double *ry, const double *rz,
+	           const unsigned char *absent, unsigned char skipBits,
+	           size_t count, double radius, double cellSize);
+
+	/* Appends [start, end) pairs of positions in entries() for x rows
+	 * rowStart to rowEnd, covering every point between minLength and
+	 * maxLength of centre (in the lattice's own frame). */
+	void shellRanges(vec3 centre,
+	                 double minLength, double maxLength,
+	                 size_t rowStart, size_t rowEnd,
+	                 std::vector<size_t> *ranges) const;
+
+	size_t rowCount() const
+	{
+		return _cells;
+	}
+
+	/* indices of the points given to build(), grouped by cell */
+	const std::vector<size_t> &entries() const
+	{
+		return _entries;
+	}
+private:
+	int cellCoord(double value) const
+	{
+		int c = (value + _radius) / _cellSize;
+		return (c < 0) ? 0 : ((c >= _cells) ? _cells - 1 : c);
+	}
+
+	size_t cellIndex(int cx, int cy, int cz) const
+	{
+		return ((size_t)cx * _cells + cy) * _cells + cz;
+	}
+
+	double _radius;
+	double _cellSize;
+	int _cells;
+
+	/* cell i holds _entries[_cellStart[i]] to _entries[_cellStart[i + 1]] */
+	std::vector<size_t> _cellStart;
+	std::vector<size_t> _entries;
+};
+
+#endif
@@ -0,0 +1,570 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+
+#include "PanelGeometry.h"
+#include "ReflectionTable.h"
+#include "FileReader.h"
+#include <iostream>
+#include <float.h>
+#include <algorithm>
+#include <stdlib.h>
+#include <math.h>
+
+PanelGeometry::PanelGeometry()
+{
+	clear();
+}
+
+void PanelGeometry::clear()
+{
+	_panels.clear();
+	_gnomonic = false;
+	_minU = 0;
+	_minV = 0;
+	_cellSizeU = 1;
+	_cellSizeV = 1;
+	_cellsU = 0;
+	_cellsV = 0;
+	_cellStart.clear();
+	_cellPanels.clear();
+}
+
+static bool parse_number(std::string value, double *result)
+{
+	char *end = NULL;
+	*result = strtod(value.c_str(), &end);
+
+	return (end != value.c_str() && *end == '\0');
+}
+
+/* e.g. "+0.0047x -0.9999y", "-y", "x+0.5z" */
+static bool parse_direction(std::string value, vec3 *result)
+{
+	*result = empty_vec3();
+	std::string number;
+	bool any = false;
+
+	for (size_t i = 0; i < value.length(); i++)
+	{
+		char c = value[i];
+
+		if (c == ' ' || c == '\t')
+		{
+			continue;
+		}
+
+		if (c != 'x' && c != 'y' && c != 'z')
+		{
+			number += c;
+			continue;
+		}
+
+		double coeff = 1;
+
+		if (number == "-")
+		{
+			coeff = -1;
+		}
+		else if (number.length() && number != "+" &&
+		         !parse_number(number, &coeff))
+		{
+			return false;
+		}
+
+		if (c == 'x') result->x += coeff;
+		if (c == 'y') result->y += coeff;
+		if (c == 'z') result->z += coeff;
+
+		number = "";
+		any = true;
+	}
+
+	return (any && number.length() == 0);
+}
+
+bool PanelGeometry::setValue(DetectorPanel *panel, std::string field,
+                             std::string value)
+{
+	double number = 0;
+	bool numeric = parse_number(value, &number);
+
+	if (field == "fs" || field == "ss")
+	{
+		vec3 dir;
+
+		if (!parse_direction(value, &dir))
+		{
+			std::cout << "Could not read direction \"" << value << "\""
+			<< std::endl;
+			return false;
+		}
+
+		(field == "fs" ? panel->fs : panel->ss) = dir;
+		return true;
+	}
+
+	if (field != "min_fs" && field != "max_fs" && field != "min_ss" &&
+	    field != "max_ss" && field != "res" && field != "clen" &&
+	    field != "coffset" && field != "corner_x" && field != "corner_y")
+	{
+		return true;
+	}
+
+	if (!numeric)
+	{
+		std::cout << "Expected a number for " << field << ", not \""
+		<< value << "\"" << std::endl;
+		return false;
+	}
+
+	if (field == "min_fs") panel->minFs = lrint(number);
+	if (field == "max_fs") panel->maxFs = lrint(number);
+	if (field == "min_ss") panel->minSs = lrint(number);
+	if (field == "max_ss") panel->maxSs = lrint(number);
+	if (field == "res") panel->res = number;
+	if (field == "clen") panel->clen = number;
+	if (field == "coffset") panel->coffset = number;
+	if (field == "corner_x") panel->cornerX = number;
+	if (field == "corner_y") panel->cornerY = number;
+
+	return true;
+}
+
+bool PanelGeometry::load(std::string filename)
+{
+	clear();
+
+	if (!file_exists(filename))
+	{
+		std::cout << "Geometry file " << filename << " does not exist."
+		<< std::endl;
+		return false;
+	}
+
+	DetectorPanel defaults;
+	defaults.minFs = 0;
+	defaults.maxFs = -1;
+	defaults.minSs = 0;
+	defaults.maxSs = -1;
+	defaults.res = 0;
+	defaults.clen = 0;
+	defaults.coffset = 0;
+	defaults.cornerX = 0;
+	defaults.cornerY = 0;
+	defaults.fs = make_vec3(1, 0, 0);
+	defaults.ss = make_vec3(0, 1, 0);
+
+	std::map<std::string, size_t> named;
+	std::string contents = get_file_contents(filename);
+	std::vector<std::string> lines = split(contents, '\n');
+
+	for (size_t i = 0; i < lines.size(); i++)
+	{
+		std::string line = lines[i];
+		size_t comment = line.find(';');
+
+		if (comment != std::string::npos)
+		{
+			line = line.substr(0, comment);
+		}
+
+		size_t equals = line.find('=');
+
+		if (equals == std::string::npos)
+		{
+			continue;
+		}
+
+		std::string key = line.substr(0, equals);
+		std::string value = line.substr(equals + 1);
+		trim(key);
+		trim(value);
+
+		DetectorPanel *panel = &defaults;
+		std::string field = key;
+		size_t slash = key.find('/');
+
+		if (slash != std::string::npos)
+		{
+			std::string name = key.substr(0, slash);
+			field = key.substr(slash + 1);
+
+			/* bad regions and rigid groups are not panels */
+			if (name.compare(0, 3, "bad") == 0 ||
+			    name.compare(0, 11, "rigid_group") == 0)
+			{
+				continue;
+			}
+
+			if (named.count(name) == 0)
+			{
+				named[name] = _panels.size();
+				_panels.push_back(defaults);
+				_panels.back().name = name;
+			}
+
+			panel = &_panels[named[name]];
+		}
+
+		if (!setValue(panel, field, value))
+		{
+			std::cout << "... on line " << i + 1 << " of " << filename
+			<< std::endl;
+			clear();
+			return false;
+		}
+	}
+
+	if (!prepare())
+	{
+		clear();
+		return false;
+	}
+
+	buildGrid();
+
+	std::cout << "Loaded " << _panels.size() << " detector panels from "
+	<< filename << std::endl;
+
+	return true;
+}
+
+bool PanelGeometry::prepare()
+{
+	if (_panels.size() == 0)
+	{
+		std::cout << "No panels found in geometry file." << std::endl;
+		return false;
+	}
+
+	for (size_t i = 0; i < _panels.size(); i++)
+	{
+		DetectorPanel *p = &_panels[i];
+
+		if (p->maxFs < p->minFs || p->maxSs < p->minSs || p->res <= 0)
+		{
+			std::cout << "Panel " << p->name << " needs min/max_fs, "
+			"min/max_ss and a positive res." << std::endl;
+			return false;
+		}
+
+		/* one pixel along fast and slow scan, in metres */
+		vec3 fs = p->fs;
+		vec3 ss = p->ss;
+		vec3_mult(&fs, 1 / p->res);
+		vec3_mult(&ss, 1 / p->res);
+		p->normal = vec3_cross_vec3(fs, ss);
+
+		if (vec3_length(p->normal) <= 0)
+		{
+			std::cout << "Panel " << p->name << " has parallel fs and ss."
+			<< std::endl;
+			return false;
+		}
+
+		p->origin = make_vec3(p->cornerX / p->res, p->cornerY / p->res,
+		                      p->clen + p->coffset);
+		p->originDotNormal = vec3_dot_vec3(p->origin, p->normal);
+
+		mat3x3 axes = make_mat3x3();
+		axes.vals[0] = fs.x; axes.vals[1] = ss.x; axes.vals[2] = p->normal.x;
+		axes.vals[3] = fs.y; axes.vals[4] = ss.y; axes.vals[5] = p->normal.y;
+		axes.vals[6] = fs.z; axes.vals[7] = ss.z; axes.vals[8] = p->normal.z;
+		p->toPanel = mat3x3_inverse(axes);
+	}
+
+	return true;
+}
+
+void PanelGeometry::buildGrid()
+{
+	size_t count = _panels.size();
+	std::vector<double> minU(count, FLT_MAX), maxU(count, -FLT_MAX);
+	std::vector<double> minV(count, FLT_MAX), maxV(count, -FLT_MAX);
+	_gnomonic = true;
+
+	/* A panel projects to the convex hull of its corners while it is
+	 * wholly in front of the sample. */
+	for (size_t i = 0; i < count && _gnomonic; i++)
+	{
+		DetectorPanel *p = &_panels[i];
+		double width = p->maxFs - p->minFs + 1;
+		double height = p->maxSs - p->minSs + 1;
+
+		for (int j = 0; j < 4; j++)
+		{
+			double a = (j & 1) ? width : 0;
+			double b = (j & 2) ? height : 0;
+			vec3 corner = make_vec3(p->cornerX + a * p->fs.x + b * p->ss.x,
+			                        p->cornerY + a * p->fs.y + b * p->ss.y,
+			                        a * p->fs.z + b * p->ss.z);
+			vec3_mult(&corner, 1 / p->res);
+			corner.z += p->clen + p->coffset;
+
+			if (corner.z <= 0)
+			{
+				_gnomonic = false;
+				break;
+			}
+
+			double u = corner.x / corner.z;
+			double v = corner.y / corner.z;
+			minU[i] = std::min(minU[i], u);
+			maxU[i] = std::max(maxU[i], u);
+			minV[i] = std::min(minV[i], v);
+			maxV[i] = std::max(maxV[i], v);
+		}
+	}
+
+	if (!_gnomonic)
+	{
+		_cellsU = 1;
+		_cellsV = 1;
+		_cellStart.resize(2);
+		_cellStart[0] = 0;
+		_cellStart[1] = count;
+		_cellPanels.resize(count);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			_cellPanels[i] = i;
+		}
+
+		return;
+	}
+
+	_minU = *std::min_element(minU.begin(), minU.end());
+	_minV = *std::min_element(minV.begin(), minV.end());
+	double spanU = *std::max_element(maxU.begin(), maxU.end()) - _minU;
+	double spanV = *std::max_element(maxV.begin(), maxV.end()) - _minV;
+
+	/* about four cells per panel, so most cells see one or two panels */
+	_cellsU = 2 * ceil(sqrt((double)count));
+	_cellsV = _cellsU;
+	_cellSizeU = std::max(spanU, DBL_EPSILON) / _cellsU;
+	_cellSizeV = std::max(spanV, DBL_EPSILON) / _cellsV;
+
+	std::vector<std::vector<int> > cells(_cellsU * _cellsV);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		int u0 = std::max(0, (int)floor((minU[i] - _minU) / _cellSizeU));
+		int u1 = std::min(_cellsU - 1,
+		                  (int)floor((maxU[i] - _minU) / _cellSizeU));
+		int v0 = std::max(0, (int)floor((minV[i] - _minV) / _cellSizeV));
+		int v1 = std::min(_cellsV - 1,
+		                  (int)floor((maxV[i] - _minV) / _cellSizeV));
+
+		for (int cv = v0; cv <= v1; cv++)
+		{
+			for (int cu = u0; cu <= u1; cu++)
+			{
+				cells[cv * _cellsU + cu].push_back(i);
+			}
+		}
+	}
+
+	_cellStart.resize(cells.size() + 1);
+	_cellStart[0] = 0;
+	_cellPanels.clear();
+
+	for (size_t i = 0; i < cells.size(); i++)
+	{
+		_cellPanels.insert(_cellPanels.end(), cells[i].begin(),
+		                   cells[i].end());
+		_cellStart[i + 1] = _cellPanels.size();
+	}
+}
+
+/* Branch-free so that it vectorises: the ray direction and its grid
+ * cell, or -1 where the ray misses the grid. */
+VECTOR_KERNEL(gnomonic_cell_kernel,
+              (const double *__restrict x,
+               const double *__restrict y,
+               const double *__restrict z,
+               size_t count, double sampleZ,
+               double minU, double minV,
+               double cellSizeU, double cellSizeV,
+               int cellsU, int cellsV,
+               double *__restrict dz,
+               int *__restrict cell),
+              (x, y, z, count, sampleZ, minU, minV, cellSizeU,
+               cellSizeV, cellsU, cellsV, dz, cell))
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		dz[i] = z[i] - sampleZ;
+		double inv = 1 / dz[i];
+
+		/* clamped to [-1, cells] so that truncation rounds down and
+		 * the int conversion stays defined; NaN ends up outside */
+		double fu = (x[i] * inv - minU) / cellSizeU + 1;
+		double fv = (y[i] * inv - minV) / cellSizeV + 1;
+		fu = (fu > 0) ? fu : 0;
+		fv = (fv > 0) ? fv : 0;
+		fu = (fu < cellsU + 1) ? fu : cellsU + 1;
+		fv = (fv < cellsV + 1) ? fv : cellsV + 1;
+		int cu = (int)fu - 1;
+		int cv = (int)fv - 1;
+
+		/* unsigned, so -1 fails too */
+		int inside = (dz[i] > 0) & ((unsigned)cu < (unsigned)cellsU) &
+		             ((unsigned)cv < (unsigned)cellsV);
+		cell[i] = inside * (cv * cellsU + cu + 1) - 1;
+	}
+}
+
+/* One panel against a run of rays: where each ray crosses the panel
+ * plane, in pixels along fs and ss from the panel corner. */
+VECTOR_KERNEL(ray_panel_kernel,
+              (const double *__restrict dx,
+               const double *__restrict dy,
+               const double *__restrict dz,
+               size_t count, const DetectorPanel &p,
+               double *__restrict outA,
+               double *__restrict outB,
+               unsigned char *__restrict hit),
+              (dx, dy, dz, count, p, outA, outB, hit))
+{
+	/* copied out so the stores below cannot alias the panel */
+	const vec3 n = p.normal;
+	const vec3 o = p.origin;
+	const double od = p.originDotNormal;
+	const double m0 = p.toPanel.vals[0], m1 = p.toPanel.vals[1];
+	const double m2 = p.toPanel.vals[2], m3 = p.toPanel.vals[3];
+	const double m4 = p.toPanel.vals[4], m5 = p.toPanel.vals[5];
+	const double width = p.maxFs - p.minFs + 1;
+	const double height = p.maxSs - p.minSs + 1;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		double along = dx[i] * n.x + dy[i] * n.y + dz[i] * n.z;
+		double t = od / along;
+		double px = t * dx[i] - o.x;
+		double py = t * dy[i] - o.y;
+		double pz = t * dz[i] - o.z;
+		double a = m0 * px + m1 * py + m2 * pz;
+		double b = m3 * px + m4 * py + m5 * pz;
+
+		outA[i] = a;
+		outB[i] = b;
+		hit[i] = (t > 0) & (a >= 0) & (a < width) & (b >= 0) & (b < height);
+	}
+}
+
+void PanelGeometry::locate(const double *x, const double *y, const double *z,
+                           size_t count, double sampleZ, double *fs,
+                           double *ss, unsigned char *hit) const
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	std::vector<double> dz(count);
+	std::vector<int> cell(count);
+
+	if (_gnomonic)
+	{
+		gnomonic_cell_kernel(x, y, z, count, sampleZ, _minU, _minV,
+		                     _cellSizeU, _cellSizeV, _cellsU, _cellsV,
+		                     dz.data(), cell.data());
+	}
+	else
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			dz[i] = z[i] - sampleZ;
+			cell[i] = 0;
+		}
+	}
+
+	/* Counting sort of the rays by cell, so that each candidate panel
+	 * is tested against a contiguous run of rays at once. */
+	int cells = _cellsU * _cellsV;
+	std::vector<int> start(cells + 1, 0);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		hit[i] = 0;
+
+		if (cell[i] >= 0)
+		{
+			start[cell[i] + 1]++;
+		}
+	}
+
+	for (int i = 0; i < cells; i++)
+	{
+		start[i + 1] += start[i];
+	}
+
+	size_t sorted = start[cells];
+	std::vector<int> order(sorted);
+	std::vector<double> sx(sorted), sy(sorted), sz(sorted);
+	std::vector<int> fillPos(start.begin(), start.end() - 1);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (cell[i] < 0)
+		{
+			continue;
+		}
+
+		int pos = fillPos[cell[i]]++;
+		order[pos] = i;
+		sx[pos] = x[i];
+		sy[pos] = y[i];
+		sz[pos] = dz[i];
+	}
+
+	std::vector<double> a(sorted), b(sorted);
+	std::vector<unsigned char> onPanel(sorted);
+
+	for (int c = 0; c < cells; c++)
+	{
+		size_t first = start[c];
+		size_t n = start[c + 1] - first;
+
+		if (n == 0)
+		{
+			continue;
+		}
+
+		for (int j = _cellStart[c]; j < _cellStart[c + 1]; j++)
+		{
+			const DetectorPanel &p = _panels[_cellPanels[j]];
+			ray_panel_kernel(&sx[first], &sy[first], &sz[first], n, p,
+			                 &a[first], &b[first], &onPanel[first]);
+
+			/* panels do not overlap, but the first to claim a ray wins */
+			for (size_t k = first; k < first + n; k++)
+			{
+				int i = order[k];
+
+				if (onPanel[k] && !hit[i])
+				{
+					fs[i] = p.minFs + a[k];
+					ss[i] = p.minSs + b[k];
+					hit[i] = 1;
+				}
+			}
+		}
+	}
+}
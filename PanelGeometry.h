@@ -0,0 +1,104 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+
+#ifndef __Windexing__PanelGeometry__
+#define __Windexing__PanelGeometry__
+
+#include <string>
+#include <vector>
+#include <map>
+#include "mat3x3.h"
+
+/* Tiled or tilted detectors (CSPAD, ePix, ...) as a list of flat panels,
+ * read from the common subset of a CrystFEL geometry file:
+ *
+ *   res = 9097.53          ; pixels per metre
+ *   clen = 0.0887          ; metres, numeric only
+ *   q0a0/min_fs = 0        ; where the panel sits in the image
+ *   q0a0/max_fs = 193
+ *   q0a0/min_ss = 0
+ *   q0a0/max_ss = 184
+ *   q0a0/fs = +0.0047x -0.9999y
+ *   q0a0/ss = +0.9999x +0.0047y
+ *   q0a0/corner_x = 443.8  ; pixels, from the beam
+ *   q0a0/corner_y = -49.9
+ *   q0a0/coffset = 0.0     ; metres, added to clen
+ *
+ * Keys without a panel name set defaults for panels named after them.
+ * Anything else in the file (masks, bad regions, rigid groups) is
+ * ignored. All geometry is held in metres from the sample. */
+
+typedef struct
+{
+	std::string name;
+	int minFs, maxFs;
+	int minSs, maxSs;
+	double res;
+	double clen;
+	double coffset;
+	double cornerX, cornerY;
+	vec3 fs, ss;
+
+	/* derived by prepare() */
+	vec3 origin; // corner of pixel (min_fs, min_ss)
+	vec3 normal;
+	double originDotNormal;
+	mat3x3 toPanel; // metres from origin to pixels along fs and ss
+} DetectorPanel;
+
+class PanelGeometry
+{
+public:
+	PanelGeometry();
+
+	bool load(std::string filename);
+	void clear();
+
+	size_t panelCount() const
+	{
+		return _panels.size();
+	}
+
+	/* Image pixel where each diffracted ray lands: ray i leaves the
+	 * sample at (0, 0, sampleZ) towards (x[i], y[i], z[i]). hit[i] is 0
+	 * for rays which miss every panel. Safe to call from many threads. */
+	void locate(const double *x, const double *y, const double *z,
+	            size_t count, double sampleZ, double *fs, double *ss,
+	            unsigned char *hit) const;
+private:
+	bool prepare();
+	void buildGrid();
+	bool setValue(DetectorPanel *panel, std::string field,
+	              std::string value);
+
+	std::vector<DetectorPanel> _panels;
+
+	/* Gnomonic (x/z, y/z) grid over the panels' footprints; cell i
+	 * lists panels _cellPanels[_cellStart[i]] onwards to
+	 * _cellStart[i + 1]. One cell holding every panel if any panel
+	 * reaches behind the sample. */
+	bool _gnomonic;
+	double _minU, _minV;
+	double _cellSizeU, _cellSizeV;
+	int _cellsU, _cellsV;
+	std::vector<int> _cellStart;
+	std::vector<int> _cellPanels;
+};
+
+#endif
@@ -0,0 +1,106 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "PredictionOverlay.h"
+#include <QtGui/qpainter.h>
+
+PredictionOverlay::PredictionOverlay(QGraphicsItem *parent)
+: QGraphicsItem(parent)
+{
+	_spotSize = 10;
+	clearSpots();
+}
+
+void PredictionOverlay::setBounds(QRectF bounds)
+{
+	if (bounds == _bounds)
+	{
+		return;
+	}
+
+	prepareGeometryChange();
+	_bounds = bounds;
+}
+
+QRectF PredictionOverlay::boundingRect() const
+{
+	return _bounds;
+}
+
+void PredictionOverlay::clearSpots()
+{
+	for (int i = 0; i < WEIGHT_BUCKETS; i++)
+	{
+		_spots[i] = QPainterPath();
+		_watched[i] = QPainterPath();
+
+		/* overlapping watched spots stay filled */
+		_watched[i].setFillRule(Qt::WindingFill);
+	}
+}
+
+void PredictionOverlay::addSpot(double x, double y, double weight,
+                                bool watched)
+{
+	int bucket = weight * WEIGHT_BUCKETS;
+	if (bucket < 0) bucket = 0;
+	if (bucket >= WEIGHT_BUCKETS) bucket = WEIGHT_BUCKETS - 1;
+
+	QRectF rect(x - _spotSize / 2, y - _spotSize / 2, _spotSize, _spotSize);
+
+	if (watched)
+	{
+		_watched[bucket].addEllipse(rect);
+	}
+	else
+	{
+		_spots[bucket].addEllipse(rect);
+	}
+}
+
+void PredictionOverlay::finishSpots()
+{
+	update();
+}
+
+void PredictionOverlay::paint(QPainter *painter,
+                              const QStyleOptionGraphicsItem *,
+                              QWidget *)
+{
+	QBrush watchBrush = QBrush(QColor(0, 0, 255, 50));
+
+	for (int i = 0; i < WEIGHT_BUCKETS; i++)
+	{
+		/* weight near zero means right on the sphere: most opaque */
+		double weight = (i + 0.5) / (double)WEIGHT_BUCKETS;
+		QPen pen = QPen(QColor(0, 0, 255, (1 - weight) * 255));
+		painter->setPen(pen);
+
+		if (!_spots[i].isEmpty())
+		{
+			painter->setBrush(Qt::NoBrush);
+			painter->drawPath(_spots[i]);
+		}
+
+		if (!_watched[i].isEmpty())
+		{
+			painter->setBrush(watchBrush);
+			painter->drawPath(_watched[i]);
+		}
+	}
+}
@@ -0,0 +1,59 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __Windexing__PredictionOverlay__
+#define __Windexing__PredictionOverlay__
+
+#include <QtWidgets/qgraphicsitem.h>
+#include <QtGui/qpainterpath.h>
+
+#define WEIGHT_BUCKETS 32
+
+/* One scene item which draws every predicted spot. Spots are gathered
+ * into one path per pen colour, so painting costs one call per colour
+ * however many spots there are. */
+
+class PredictionOverlay : public QGraphicsItem
+{
+public:
+	PredictionOverlay(QGraphicsItem *parent = NULL);
+
+	void setBounds(QRectF bounds);
+	void setSpotSize(double size)
+	{
+		_spotSize = size;
+	}
+
+	/* Between clearSpots and finishSpots, add each spot to be drawn */
+	void clearSpots();
+	void addSpot(double x, double y, double weight, bool watched);
+	void finishSpots();
+
+	virtual QRectF boundingRect() const;
+	virtual void paint(QPainter *painter,
+	                   const QStyleOptionGraphicsItem *option,
+	                   QWidget *widget);
+private:
+	QRectF _bounds;
+	double _spotSize;
+
+	QPainterPath _spots[WEIGHT_BUCKETS];
+	QPainterPath _watched[WEIGHT_BUCKETS];
+};
+
+#endif
@@ -33,8 +33,11 @@
 #include <QtGui/qpixmap.h>
 #include <QtWidgets/qfiledialog.h>
 #include <QtWidgets/qgraphicsview.h>
+#include <QtCore/qtimer.h>
 
 #define MOUSE_SENSITIVITY 1000
+#define FRAME_INTERVAL_MS 16
+#define IDLE_BEFORE_FILL_MS 100
 
 PredictionView::PredictionView(QWidget *parent) : QGraphicsView(parent)
 {
@@ -42,12 +45,98 @@ PredictionView::PredictionView(QWidget *parent) : QGraphicsView(parent)
     _lastY = -1;
     _crystal = 0;
     _tinker = 0;
-    _keyPresses = 0;
-    _keyPressSwitch = 5;
     _fixAxisStage = 0;
     _refineStage = 0;
 	_identifyHklStage = 0;
     _radPerKeyPress = 1. / 500.;
+
+    _pendingRotation = make_vec3(0, 0, 0);
+    _hasPending = false;
+    _frameTimer = new QTimer(this);
+    _frameTimer->setInterval(FRAME_INTERVAL_MS);
+    connect(_frameTimer, &QTimer::timeout, this, [=]{ frameTick(); });
+
+    _idleTimer = new QTimer(this);
+    _idleTimer->setSingleShot(true);
+    _idleTimer->setInterval(IDLE_BEFORE_FILL_MS);
+    connect(_idleTimer, &QTimer::timeout, this, [=]{ startFillIn(); });
+
+    _fillTimer = new QTimer(this);
+    _fillTimer->setInterval(0);
+    connect(_fillTimer, &QTimer::timeout, this, [=]{ fillInTick(); });
+}
+
+/* Fine detail is left out while the crystal is turning and filled in a
+ * slice per event loop pass once input has paused, so the fill-in never
+ * holds up the next key press or drag. */
+void PredictionView::startFillIn()
+{
+    _crystal->endInteraction();
+    _fillTimer->start();
+}
+
+void PredictionView::fillInTick()
+{
+    bool done = _crystal->fillInSlice();
+    _tinker->drawPredictions();
+
+    if (done)
+    {
+        _fillTimer->stop();
+    }
+}
+
+/* Rotations arriving faster than the display can follow are summed and
+ * drawn at most once a frame. The first after a quiet spell is drawn
+ * straight away, so input is never more than a frame behind. */
+void PredictionView::queueRotation(double diffX, double diffY, double diffZ)
+{
+    _pendingRotation.x += diffX;
+    _pendingRotation.y += diffY;
+    _pendingRotation.z += diffZ;
+    _hasPending = true;
+
+    _fillTimer->stop();
+
+    /* reflections being picked for refinement must stay on screen */
+    if (_refineStage == 0)
+    {
+        _crystal->beginInteraction();
+    }
+
+    _idleTimer->start();
+
+    if (!_frameTimer->isActive())
+    {
+        applyPendingRotation();
+        _tinker->drawPredictions();
+        _frameTimer->start();
+    }
+}
+
+void PredictionView::applyPendingRotation()
+{
+    if (!_hasPending)
+    {
+        return;
+    }
+
+    _crystal->applyRotation(_pendingRotation.x, _pendingRotation.y,
+                            _pendingRotation.z);
+    _pendingRotation = make_vec3(0, 0, 0);
+    _hasPending = false;
+}
+
+void PredictionView::frameTick()
+{
+    if (!_hasPending)
+    {
+        _frameTimer->stop();
+        return;
+    }
+
+    applyPendingRotation();
+    _tinker->drawPredictions();
 }
 
 void PredictionView::keyPressEvent(QKeyEvent *event)
@@ -76,21 +165,20 @@ void PredictionView::keyPressEvent(QKeyEvent *event)
         return;
     }
     
-    _keyPresses++;
-
-    _crystal->applyRotation(diffX, diffY, 0);
-    
-    if (_keyPresses > _keyPressSwitch)
-    {
-        _keyPresses = 0;
-        _crystal->populateMillers();
-    }
-    
-    _tinker->drawPredictions();
+    /* The crystal picks reflections near the shell again by itself once
+     * it has turned far enough to need to */
+    queueRotation(diffX, diffY, 0);
 }
 
 void PredictionView::mousePressEvent(QMouseEvent *e)
 {
+    /* Picking must see the spots as they will be drawn */
+    if (_hasPending)
+    {
+        applyPendingRotation();
+        _tinker->drawPredictions();
+    }
+
     if (_fixAxisStage >= 1)
     {
         vec3 position = make_vec3(e->x(), e->y(), 0);
@@ -162,7 +250,6 @@ void PredictionView::mousePressEvent(QMouseEvent *e)
     if (_fixAxisStage == 0)
     {
         _lastX = -1; _lastY = -1;
-        _crystal->populateMillers();
         _tinker->drawPredictions();
         
         return;
@@ -206,15 +293,12 @@ void PredictionView::mouseMoveEvent(QMouseEvent *e)
             std::cout << "No crystal set!" << std::endl;
         }
 
-		std::cout << "Applying rotation " << dot << std::endl;
-        _crystal->applyRotation(0, 0, dot);
-        
         if (!_tinker)
         {
             std::cout << "No tinker set!" << std::endl;        
         }
         
-        _tinker->drawPredictions();
+        queueRotation(0, 0, dot);
     }
     
     _lastX = newX; _lastY = newY;
@@ -25,6 +25,7 @@
 #include <QtWidgets/qgraphicsview.h>
 
 class Tinker;
+class QTimer;
 
 class PredictionView : public QGraphicsView
 {
@@ -51,7 +52,6 @@ public:
     void setRadiansPerKeyPress(double rad)
     {
         _radPerKeyPress = rad;
-        _keyPressSwitch = deg2rad(0.5) / rad;
     }
 
     void setFixAxisStage(int stage);
@@ -62,6 +62,12 @@ protected:
     virtual void mousePressEvent(QMouseEvent *e);
     virtual void mouseMoveEvent(QMouseEvent *e);
     virtual void keyPressEvent(QKeyEvent *event);
+
+    void queueRotation(double diffX, double diffY, double diffZ);
+    void applyPendingRotation();
+    void frameTick();
+    void startFillIn();
+    void fillInTick();
    
     Detector *_detector; 
     Crystal *_crystal;
@@ -70,9 +76,6 @@ protected:
     int _lastX;
     int _lastY;
     
-    int _keyPresses;
-    int _keyPressSwitch;
-        
     int _fixAxisStage;
     int _refineStage;
 	int _identifyHklStage;
@@ -82,6 +85,16 @@ protected:
 	int _singleWatch;
     
     vec3 _fixAxisPoints[2];
+
+    /* Rotation received but not yet applied, and the frame clock
+     * which applies it */
+    vec3 _pendingRotation;
+    bool _hasPending;
+    QTimer *_frameTimer;
+
+    /* Starts filling in fine detail once input pauses, then runs it */
+    QTimer *_idleTimer;
+    QTimer *_fillTimer;
 };
 
 #endif 
@@ -0,0 +1,451 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+
+#include "RawImage.h"
+#include "FileReader.h"
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+RawImage::RawImage()
+{
+	_map = NULL;
+	_mapSize = 0;
+	close();
+}
+
+RawImage::~RawImage()
+{
+	close();
+}
+
+void RawImage::close()
+{
+	if (_map != NULL)
+	{
+		munmap(_map, _mapSize);
+	}
+
+	_map = NULL;
+	_mapSize = 0;
+	_pixels = NULL;
+	_width = 0;
+	_height = 0;
+	_type = RawUInt16;
+	_swap = false;
+}
+
+static size_t type_size(RawDataType type)
+{
+	return (type == RawUInt16 || type == RawInt16) ? 2 : 4;
+}
+
+static bool host_is_little_endian()
+{
+	unsigned short one = 1;
+	return *(unsigned char *)&one == 1;
+}
+
+static bool starts_with_magic(const unsigned char *bytes, size_t size)
+{
+	size_t length = strlen(RAW_IMAGE_MAGIC);
+	return (size >= length && memcmp(bytes, RAW_IMAGE_MAGIC, length) == 0);
+}
+
+bool RawImage::recognise(std::string filename)
+{
+	if (file_exists(filename + ".hdr"))
+	{
+		return true;
+	}
+
+	int fd = open(filename.c_str(), O_RDONLY);
+
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	unsigned char start[16];
+	ssize_t got = read(fd, start, sizeof(start));
+	::close(fd);
+
+	return (got > 0 && starts_with_magic(start, got));
+}
+
+bool RawImage::readHeader(std::string header, bool embedded, size_t *offset,
+                          std::string filename)
+{
+	bool haveOffset = false;
+	bool ended = !embedded;
+	bool little = true;
+	size_t pos = 0;
+
+	while (pos < header.length())
+	{
+		size_t next = header.find('\n', pos);
+
+		if (next == std::string::npos)
+		{
+			next = header.length();
+		}
+
+		std::string line = header.substr(pos, next - pos);
+		pos = next + 1;
+
+		size_t comment = line.find(';');
+
+		if (comment != std::string::npos)
+		{
+			line = line.substr(0, comment);
+		}
+
+		trim(line);
+
+		if (line == RAW_IMAGE_MAGIC || line.length() == 0)
+		{
+			continue;
+		}
+
+		if (line == "end")
+		{
+			ended = true;
+			break;
+		}
+
+		size_t space = line.find_first_of(" \t");
+		std::string key = line.substr(0, space);
+		std::string value;
+
+		if (space != std::string::npos)
+		{
+			value = line.substr(space + 1);
+			trim(value);
+		}
+
+		if (key == "width") _width = atoi(value.c_str());
+		else if (key == "height") _height = atoi(value.c_str());
+		else if (key == "offset")
+		{
+			*offset = strtoul(value.c_str(), NULL, 10);
+			haveOffset = true;
+		}
+		else if (key == "endian" && (value == "little" || value == "big"))
+		{
+			little = (value == "little");
+		}
+		else if (key == "dtype")
+		{
+			if (value == "uint16") _type = RawUInt16;
+			else if (value == "int16") _type = RawInt16;
+			else if (value == "uint32") _type = RawUInt32;
+			else if (value == "int32") _type = RawInt32;
+			else if (value == "float32") _type = RawFloat32;
+			else
+			{
+				std::cout << "Unknown dtype \"" << value << "\" in header of "
+				<< filename << std::endl;
+				return false;
+			}
+		}
+		else
+		{
+			std::cout << "Unknown line \"" << line << "\" in header of "
+			<< filename << std::endl;
+			return false;
+		}
+	}
+
+	if (!ended)
+	{
+		std::cout << "Header of " << filename << " has no \"end\" line."
+		<< std::endl;
+		return false;
+	}
+
+	if (embedded && !haveOffset)
+	{
+		*offset = pos;
+	}
+
+	_swap = (little != host_is_little_endian());
+
+	return true;
+}
+
+bool RawImage::load(std::string filename)
+{
+	close();
+
+	int fd = open(filename.c_str(), O_RDONLY);
+	struct stat info;
+
+	if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0)
+	{
+		std::cout << "Could not open raw frame " << filename << std::endl;
+
+		if (fd >= 0) ::close(fd);
+		return false;
+	}
+
+	/* The mapping outlives the descriptor */
+	_mapSize = info.st_size;
+	_map = mmap(NULL, _mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+
+	if (_map == MAP_FAILED)
+	{
+		std::cout << "Could not map raw frame " << filename << std::endl;
+		_map = NULL;
+		close();
+		return false;
+	}
+
+	const unsigned char *bytes = (const unsigned char *)_map;
+	std::string header;
+	bool embedded = false;
+	size_t offset = 0;
+
+	if (file_exists(filename + ".hdr"))
+	{
+		header = get_file_contents(filename + ".hdr");
+	}
+	else if (starts_with_magic(bytes, _mapSize))
+	{
+		size_t length = std::min(_mapSize, (size_t)4096);
+		header = std::string((const char *)bytes, length);
+		embedded = true;
+	}
+	else
+	{
+		std::cout << "No " << filename << ".hdr describing raw frame."
+		<< std::endl;
+		close();
+		return false;
+	}
+
+	if (!readHeader(header, embedded, &offset, filename))
+	{
+		close();
+		return false;
+	}
+
+	size_t needed = (size_t)_width * _height * type_size(_type);
+
+	if (_width <= 0 || _height <= 0 || offset + needed > _mapSize)
+	{
+		std::cout << "Raw frame " << filename << " is smaller than its "
+		"header says (" << _width << " x " << _height << " from byte "
+		<< offset << ")." << std::endl;
+		close();
+		return false;
+	}
+
+	_pixels = bytes + offset;
+
+	std::cout << "Mapped " << _width << " x " << _height << " raw frame "
+	<< filename << std::endl;
+
+	return true;
+}
+
+template <typename T, bool swap>
+static inline double load_pixel(const unsigned char *p)
+{
+	T v;
+
+	if (swap)
+	{
+		unsigned char reversed[sizeof(T)];
+
+		for (size_t i = 0; i < sizeof(T); i++)
+		{
+			reversed[i] = p[sizeof(T) - 1 - i];
+		}
+
+		memcpy(&v, reversed, sizeof(T));
+	}
+	else
+	{
+		memcpy(&v, p, sizeof(T));
+	}
+
+	return v;
+}
+
+template <bool swap>
+static double load_any(RawDataType type, const unsigned char *p)
+{
+	switch (type)
+	{
+		case RawUInt16:
+		return load_pixel<unsigned short, swap>(p);
+		case RawInt16:
+		return load_pixel<short, swap>(p);
+		case RawUInt32:
+		return load_pixel<unsigned int, swap>(p);
+		case RawInt32:
+		return load_pixel<int, swap>(p);
+		default:
+		return load_pixel<float, swap>(p);
+	}
+}
+
+double RawImage::value(int x, int y) const
+{
+	size_t index = (size_t)y * _width + x;
+	const unsigned char *p = _pixels + index * type_size(_type);
+
+	return _swap ? load_any<true>(_type, p) : load_any<false>(_type, p);
+}
+
+double RawImage::suggestedMaximum() const
+{
+	if (_pixels == NULL)
+	{
+		return 1;
+	}
+
+	/* about 65536 samples, so only a scattering of pages is read */
+	int step = sqrt((double)_width * _height / 65536);
+	step = std::max(step, 1);
+	std::vector<double> sample;
+
+	/* a frame narrower than half a step still gets its one row/column */
+	int startX = std::min(step / 2, _width - 1);
+	int startY = std::min(step / 2, _height - 1);
+
+	for (int y = startY; y < _height; y += step)
+	{
+		for (int x = startX; x < _width; x += step)
+		{
+			sample.push_back(value(x, y));
+		}
+	}
+
+	if (sample.size() == 0)
+	{
+		return 1;
+	}
+
+	size_t nth = sample.size() * 995 / 1000;
+	std::nth_element(sample.begin(), sample.begin() + nth, sample.end());
+
+	return std::max(sample[nth], 1.);
+}
+
+template <typename T, bool swap>
+void RawImage::renderRows(double x0, double y0, double x1, double y1,
+                          int outWidth, int outHeight, int rowStart,
+                          int rowEnd, double maxCount, unsigned char *out,
+                          int stride) const
+{
+	double scaleX = (x1 - x0) / outWidth;
+	double scaleY = (y1 - y0) / outHeight;
+
+	/* source columns under each output column, at least one wide */
+	std::vector<int> colStart(outWidth), colEnd(outWidth);
+
+	for (int i = 0; i < outWidth; i++)
+	{
+		int start = floor(x0 + i * scaleX);
+		int end = std::max((int)floor(x0 + (i + 1) * scaleX), start + 1);
+		colStart[i] = std::max(start, 0);
+		colEnd[i] = std::min(end, _width);
+	}
+
+	std::vector<double> brightest(outWidth);
+
+	for (int j = rowStart; j < rowEnd; j++)
+	{
+		int start = floor(y0 + j * scaleY);
+		int end = std::max((int)floor(y0 + (j + 1) * scaleY), start + 1);
+		start = std::max(start, 0);
+		end = std::min(end, _height);
+
+		std::fill(brightest.begin(), brightest.end(), 0.);
+
+		for (int y = start; y < end; y++)
+		{
+			const unsigned char *row = _pixels + (size_t)y * _width * sizeof(T);
+
+			for (int i = 0; i < outWidth; i++)
+			{
+				for (int x = colStart[i]; x < colEnd[i]; x++)
+				{
+					double v = load_pixel<T, swap>(row + x * sizeof(T));
+					brightest[i] = std::max(brightest[i], v);
+				}
+			}
+		}
+
+		unsigned char *grey = out + (size_t)j * stride;
+
+		for (int i = 0; i < outWidth; i++)
+		{
+			double level = std::min(brightest[i] / maxCount, 1.);
+			grey[i] = 255 - lrint(255 * level);
+		}
+	}
+}
+
+void RawImage::render(double x0, double y0, double x1, double y1,
+                      int outWidth, int outHeight, int rowStart, int rowEnd,
+                      double maxCount, unsigned char *out, int stride) const
+{
+	if (_pixels == NULL || outWidth <= 0 || outHeight <= 0)
+	{
+		return;
+	}
+
+	maxCount = std::max(maxCount, 1e-6);
+
+#define RENDER_AS(T) \
+	(_swap ? renderRows<T, true>(x0, y0, x1, y1, outWidth, outHeight, \
+	                             rowStart, rowEnd, maxCount, out, stride) \
+	       : renderRows<T, false>(x0, y0, x1, y1, outWidth, outHeight, \
+	                              rowStart, rowEnd, maxCount, out, stride))
+
+	switch (_type)
+	{
+		case RawUInt16:
+		RENDER_AS(unsigned short);
+		break;
+		case RawInt16:
+		RENDER_AS(short);
+		break;
+		case RawUInt32:
+		RENDER_AS(unsigned int);
+		break;
+		case RawInt32:
+		RENDER_AS(int);
+		break;
+		default:
+		RENDER_AS(float);
+		break;
+	}
+
+#undef RENDER_AS
+}
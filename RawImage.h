@@ -0,0 +1,129 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+
+#ifndef __Windexing__RawImage__
+#define __Windexing__RawImage__
+
+#include <string>
+#include <stddef.h>
+
+#define RAW_IMAGE_MAGIC "RAWFRAME"
+
+typedef enum
+{
+	RawUInt16,
+	RawInt16,
+	RawUInt32,
+	RawInt32,
+	RawFloat32
+} RawDataType;
+
+/* A flat binary detector frame, memory-mapped rather than read, so the
+ * counts stay at their native depth and only the pages actually looked
+ * at are ever touched. The layout comes from a sidecar frame.raw.hdr,
+ * or from a text header at the start of the file itself:
+ *
+ *   RAWFRAME          ; embedded header only
+ *   width 1744
+ *   height 1751
+ *   dtype uint16      ; uint16 int16 uint32 int32 float32
+ *   endian little     ; or big, default little
+ *   offset 4096       ; bytes before the first pixel
+ *   end               ; embedded header only
+ *
+ * An embedded header without an offset is followed directly by the
+ * pixels. Rows are width pixels long with no padding. */
+
+class RawImage
+{
+public:
+	RawImage();
+	~RawImage();
+
+	/* True if filename has a sidecar or embedded header */
+	static bool recognise(std::string filename);
+
+	bool load(std::string filename);
+	void close();
+
+	int width() const
+	{
+		return _width;
+	}
+
+	int height() const
+	{
+		return _height;
+	}
+
+	RawDataType dataType() const
+	{
+		return _type;
+	}
+
+	/* Whether pixels() can be read as-is on this machine */
+	bool nativeOrder() const
+	{
+		return !_swap;
+	}
+
+	/* First pixel of the mapped frame, in the file's own byte order */
+	const void *pixels() const
+	{
+		return _pixels;
+	}
+
+	/* Counts at a pixel, in host byte order */
+	double value(int x, int y) const;
+
+	/* A count near the top of the frame's range, ignoring the odd hot
+	 * pixel, from a sparse sample of the frame. */
+	double suggestedMaximum() const;
+
+	/* Grey levels for output rows rowStart to rowEnd of the source
+	 * rectangle (x0, y0)-(x1, y1) drawn at outWidth by outHeight. Each
+	 * output pixel shows the brightest count it covers, from white at
+	 * zero to black at maxCount, so single-pixel spots survive
+	 * shrinking. Only the source pixels under those rows are read. */
+	void render(double x0, double y0, double x1, double y1,
+	            int outWidth, int outHeight, int rowStart, int rowEnd,
+	            double maxCount, unsigned char *out, int stride) const;
+private:
+	RawImage(const RawImage &);
+	RawImage &operator=(const RawImage &);
+
+	bool readHeader(std::string header, bool embedded, size_t *offset,
+	                std::string filename);
+
+	template <typename T, bool swap>
+	void renderRows(double x0, double y0, double x1, double y1,
+	                int outWidth, int outHeight, int rowStart, int rowEnd,
+	                double maxCount, unsigned char *out, int stride) const;
+
+	int _width;
+	int _height;
+	RawDataType _type;
+	bool _swap;
+
+	void *_map;
+	size_t _mapSize;
+	const unsigned char *_pixels;
+};
+
+#endif
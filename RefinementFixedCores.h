@@ -0,0 +1,462 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __Windexing__RefinementFixedCores__
+#define __Windexing__RefinementFixedCores__
+
+#include <array>
+#include <float.h>
+#include <math.h>
+#include "RefinementStrategy.h"
+
+/* Fixed-dimension versions of the Nelder-Mead and step-search inner
+ * loops, for the handful of parameters refined in practice. Points live
+ * in std::arrays and are updated in place, so an iteration allocates
+ * nothing beyond what the objective itself does. The strategies choose
+ * these automatically up to MAX_FIXED_PARAMETERS. */
+
+#define MAX_FIXED_PARAMETERS 8
+
+/* One Nelder-Mead simplex of N + 1 points. _order lists the points from
+ * best to worst and is kept sorted by insertion as points are replaced,
+ * rather than re-sorted. The moves are those of NelderMead::iterate. */
+
+template <int N>
+class FixedSimplex
+{
+public:
+	typedef std::array<double, N> Point;
+
+	FixedSimplex(RefinementStrategy *owner, double alpha, double gamma,
+	             double rho, double sigma)
+	{
+		_owner = owner;
+		_alpha = alpha;
+		_gamma = gamma;
+		_rho = rho;
+		_sigma = sigma;
+	}
+
+	template <class TestPoints>
+	void load(TestPoints &testPoints)
+	{
+		for (int i = 0; i <= N; i++)
+		{
+			for (int j = 0; j < N; j++)
+			{
+				_points[i][j] = testPoints[i].first[j];
+			}
+
+			_scores[i] = testPoints[i].second;
+			_order[i] = i;
+		}
+
+		sortOrder();
+	}
+
+	/* Written back best first */
+	template <class TestPoints>
+	void store(TestPoints *testPoints)
+	{
+		for (int i = 0; i <= N; i++)
+		{
+			int which = _order[i];
+
+			for (int j = 0; j < N; j++)
+			{
+				(*testPoints)[i].first[j] = _points[which][j];
+			}
+
+			(*testPoints)[i].second = _scores[which];
+		}
+	}
+
+	double bestScore()
+	{
+		return _scores[_order[0]];
+	}
+
+	double worstScore()
+	{
+		return _scores[_order[N]];
+	}
+
+	/* Every vertex within tolerances[j] of the best in parameter j */
+	template <class Tolerances>
+	bool collapsed(Tolerances &tolerances)
+	{
+		const Point &best = _points[_order[0]];
+
+		for (int i = 1; i <= N; i++)
+		{
+			const Point &point = _points[_order[i]];
+
+			for (int j = 0; j < N; j++)
+			{
+				if (!(fabs(point[j] - best[j]) < tolerances[j]))
+				{
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	void step()
+	{
+		calculateCentroid();
+
+		double reflected = trialPoint(_alpha, &_trial);
+
+		if (reflected < _scores[_order[1]])
+		{
+			replaceWorst(_trial, reflected);
+			return;
+		}
+
+		if (reflected < _scores[_order[0]])
+		{
+			Point expandedPoint;
+			double expanded = trialPoint(_gamma, &expandedPoint);
+
+			if (expanded < reflected)
+			{
+				replaceWorst(expandedPoint, expanded);
+			}
+			else
+			{
+				replaceWorst(_trial, reflected);
+			}
+
+			return;
+		}
+
+		double contracted = trialPoint(_rho, &_trial);
+
+		if (contracted < _scores[_order[N]])
+		{
+			replaceWorst(_trial, contracted);
+			return;
+		}
+
+		reduction();
+	}
+
+private:
+	void calculateCentroid()
+	{
+		_centroid.fill(0);
+
+		for (int i = 0; i < N; i++)
+		{
+			const Point &point = _points[_order[i]];
+
+			for (int j = 0; j < N; j++)
+			{
+				_centroid[j] += point[j];
+			}
+		}
+
+		for (int j = 0; j < N; j++)
+		{
+			_centroid[j] /= N;
+		}
+	}
+
+	/* centroid + scale * (centroid - worst), scored */
+	double trialPoint(double scale, Point *point)
+	{
+		const Point &worst = _points[_order[N]];
+
+		for (int j = 0; j < N; j++)
+		{
+			(*point)[j] = _centroid[j] + scale * (_centroid[j] - worst[j]);
+		}
+
+		return _owner->evaluateAt(point->data());
+	}
+
+	/* The worst point is overwritten, then moved up past every point
+	 * which scores worse. */
+	void replaceWorst(const Point &point, double score)
+	{
+		int slot = _order[N];
+		_points[slot] = point;
+		_scores[slot] = score;
+
+		int i = N;
+
+		while (i > 0 && score < _scores[_order[i - 1]])
+		{
+			_order[i] = _order[i - 1];
+			i--;
+		}
+
+		_order[i] = slot;
+	}
+
+	/* Every point but the best moves towards it; the moved points are
+	 * scored together. */
+	void reduction()
+	{
+		const Point best = _points[_order[0]];
+		std::array<double, N * N> moved;
+
+		for (int i = 1; i <= N; i++)
+		{
+			Point &point = _points[_order[i]];
+
+			for (int j = 0; j < N; j++)
+			{
+				point[j] = best[j] + _sigma * (point[j] - best[j]);
+				moved[(i - 1) * N + j] = point[j];
+			}
+		}
+
+		std::array<double, N> scores;
+		_owner->evaluateBatch(moved.data(), N, scores.data());
+
+		for (int i = 1; i <= N; i++)
+		{
+			_scores[_order[i]] = scores[i - 1];
+		}
+
+		sortOrder();
+	}
+
+	/* Insertion sort: the simplex is tiny and usually nearly sorted */
+	void sortOrder()
+	{
+		for (int i = 1; i <= N; i++)
+		{
+			int which = _order[i];
+			int k = i;
+
+			while (k > 0 && _scores[which] < _scores[_order[k - 1]])
+			{
+				_order[k] = _order[k - 1];
+				k--;
+			}
+
+			_order[k] = which;
+		}
+	}
+
+	RefinementStrategy *_owner;
+	double _alpha;
+	double _gamma;
+	double _rho;
+	double _sigma;
+
+	std::array<Point, N + 1> _points;
+	std::array<double, N + 1> _scores;
+	std::array<int, N + 1> _order;
+	Point _centroid;
+	Point _trial;
+};
+
+/* The step search's per-parameter moves, chosen at run time through this
+ * interface so the cycle loop is shared with the general version. */
+
+class FixedStepCore
+{
+public:
+	virtual ~FixedStepCore() {};
+	virtual double minimizeParameter(int which, double *bestScore) = 0;
+	virtual double minimizeTwoParameters(int which1, int which2,
+	                                     double *bestScore) = 0;
+};
+
+template <int N>
+class FixedStepSearch : public FixedStepCore
+{
+public:
+	typedef std::array<double, N> Point;
+
+	FixedStepSearch(RefinementStrategy *owner)
+	{
+		_owner = owner;
+	}
+
+	/* Tries one step either side; halves the step if neither helps. */
+	virtual double minimizeParameter(int which, double *bestScore)
+	{
+		double step = _owner->stepSizes[which];
+
+		if (step < _owner->otherValues[which])
+		{
+			return 1;
+		}
+
+		Point current;
+		readCurrent(&current);
+		double bestParam = current[which];
+
+		double scores[3];
+		double trials[3] = {bestParam - step, bestParam, bestParam + step};
+
+		if (*bestScore != FLT_MAX)
+		{
+			scores[1] = *bestScore;
+		}
+		else
+		{
+			scores[1] = notNan(_owner->evaluateAt(current.data()));
+		}
+
+		std::array<double, 2 * N> points;
+		double sides[2];
+
+		for (int k = 0; k < 2; k++)
+		{
+			for (int j = 0; j < N; j++)
+			{
+				points[k * N + j] = current[j];
+			}
+
+			points[k * N + which] = trials[k * 2];
+		}
+
+		_owner->evaluateBatch(points.data(), 2, sides);
+		scores[0] = notNan(sides[0]);
+		scores[2] = notNan(sides[1]);
+
+		int minNum = 1;
+
+		for (int i = 0; i < 3; i++)
+		{
+			if (scores[i] < scores[minNum])
+			{
+				minNum = i;
+			}
+		}
+
+		(*_owner->setters[which])(_owner->objects[which], trials[minNum]);
+		*bestScore = scores[minNum];
+
+		if (minNum == 1)
+		{
+			_owner->stepSizes[which] /= 2;
+		}
+
+		return 0;
+	}
+
+	/* Scores a 3 x 3 grid around the current pair; halves both steps if
+	 * the centre wins. */
+	virtual double minimizeTwoParameters(int which1, int which2,
+	                                     double *bestScore)
+	{
+		double *step1 = &_owner->stepSizes[which1];
+		double *step2 = &_owner->stepSizes[which2];
+
+		if (*step1 < _owner->otherValues[which1] &&
+		    *step2 < _owner->otherValues[which2])
+		{
+			return 1;
+		}
+
+		Point current;
+		readCurrent(&current);
+
+		std::array<double, 9 * N> points;
+		double scores[9];
+
+		for (int a = 0; a < 3; a++)
+		{
+			for (int b = 0; b < 3; b++)
+			{
+				double *point = &points[(a * 3 + b) * N];
+
+				for (int j = 0; j < N; j++)
+				{
+					point[j] = current[j];
+				}
+
+				point[which1] = current[which1] + (a - 1) * *step1;
+				point[which2] = current[which2] + (b - 1) * *step2;
+			}
+		}
+
+		_owner->evaluateBatch(points.data(), 9, scores);
+
+		double minScore = *bestScore;
+		int minNum = 4;
+
+		for (int i = 0; i < 9; i++)
+		{
+			if (notNan(scores[i]) < minScore)
+			{
+				minScore = scores[i];
+				minNum = i;
+			}
+		}
+
+		(*_owner->setters[which1])(_owner->objects[which1],
+		                           points[minNum * N + which1]);
+		(*_owner->setters[which2])(_owner->objects[which2],
+		                           points[minNum * N + which2]);
+
+		if (minNum == 4)
+		{
+			*step1 /= 2;
+			*step2 /= 2;
+		}
+
+		*bestScore = minScore;
+
+		return 0;
+	}
+
+private:
+	void readCurrent(Point *current)
+	{
+		for (int j = 0; j < N; j++)
+		{
+			(*current)[j] = (*_owner->getters[j])(_owner->objects[j]);
+		}
+	}
+
+	static double notNan(double score)
+	{
+		return (score != score) ? FLT_MAX : score;
+	}
+
+	RefinementStrategy *_owner;
+};
+
+/* A FixedStepSearch for this many parameters, or NULL if there are too
+ * many (the caller then uses the general code). */
+inline FixedStepCore *makeFixedStepCore(RefinementStrategy *owner, int count)
+{
+	switch (count)
+	{
+		case 1: return new FixedStepSearch<1>(owner);
+		case 2: return new FixedStepSearch<2>(owner);
+		case 3: return new FixedStepSearch<3>(owner);
+		case 4: return new FixedStepSearch<4>(owner);
+		case 5: return new FixedStepSearch<5>(owner);
+		case 6: return new FixedStepSearch<6>(owner);
+		case 7: return new FixedStepSearch<7>(owner);
+		case 8: return new FixedStepSearch<8>(owner);
+		default: return NULL;
+	}
+}
+
+#endif
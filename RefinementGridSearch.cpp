@@ -37,50 +37,93 @@
 #include <iostream>
 #include <iomanip>
 #include "FileReader.h"
+#include "ThreadPool.h"
+#include <algorithm>
 
 int RefinementGridSearch::_refine_counter = 0;
 
-void RefinementGridSearch::recursiveEvaluation(ParamList referenceList, ParamList workingList, ResultMap *results)
+/* Same points as the old recursive scan: -length / 2 to length / 2 steps
+ * either side of the current value, for length = stepSize / otherValue. */
+size_t RefinementGridSearch::prepareGrid()
 {
-    size_t paramCount = objects.size();
-    size_t workingCount = workingList.size();
-	double grid_length = stepSizes[workingCount] / otherValues[workingCount];
+	size_t total = 1;
+	_gridStart.clear();
+	_gridCount.clear();
 
-    if (workingCount < paramCount)
-    {
-        if (workingCount == 1)
-        {
-       //     std::cout << "." << std::flush;
-        }
-        
-        for (int i = -grid_length / 2; i <= (int)(grid_length / 2 + 0.5); i++)
-        {
-            double mean = referenceList[workingCount];
-            double step = otherValues[workingCount];
-            double value = mean + i * step;
-            
-            ParamList extended = workingList;
-            extended.push_back(value);
-            recursiveEvaluation(referenceList, extended, results);
-        }
-        
-        return;
-    }
-    
-    for (size_t i = 0; i < workingList.size(); i++)
-    {
-        Setter setter = setters[i];
-        (*setter)(objects[i], workingList[i]);
-    }
-    
-    double result = (*evaluationFunction)(evaluateObject);
-    (*results)[workingList] = result;
-	reverseResults[result] = workingList;
-    
-    orderedParams.push_back(workingList);
-    orderedResults.push_back(result);
-    
-    reportProgress(result);
+	for (size_t i = 0; i < objects.size(); i++)
+	{
+		double grid_length = stepSizes[i] / otherValues[i];
+		int start = -grid_length / 2;
+		int end = (int)(grid_length / 2 + 0.5);
+		int count = (end >= start) ? end - start + 1 : 0;
+
+		_gridStart.push_back(start);
+		_gridCount.push_back(count);
+		total *= count;
+	}
+
+	return total;
+}
+
+/* The last parameter varies fastest. */
+void RefinementGridSearch::gridPoint(size_t index, ParamList &reference,
+                                     ParamList *values)
+{
+	values->resize(objects.size());
+
+	for (int i = (int)objects.size() - 1; i >= 0; i--)
+	{
+		int step = _gridStart[i] + (int)(index % _gridCount[i]);
+		index /= _gridCount[i];
+		(*values)[i] = reference[i] + step * otherValues[i];
+	}
+}
+
+/* Fills _gridResults by linear index, a slice at a time through
+ * evaluatePoints(), so that the points are spread over the threads when
+ * the evaluation object can be cloned. Progress is reported between
+ * slices. */
+void RefinementGridSearch::evaluateGrid(ParamList &reference)
+{
+	size_t total = prepareGrid();
+	_gridResults.assign(total, nan(" "));
+
+	size_t slice = ThreadPool::pool()->threadCount() * 256;
+	std::vector<ParamList> points;
+	std::vector<double> scores;
+	double best = FLT_MAX;
+
+	for (size_t first = 0; first < total; first += slice)
+	{
+		if (shouldStop())
+		{
+			return;
+		}
+
+		size_t count = std::min(slice, total - first);
+		points.resize(count);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			gridPoint(first + i, reference, &points[i]);
+		}
+
+		evaluatePoints(points, &scores);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			_gridResults[first + i] = scores[i];
+
+			if (scores[i] < best)
+			{
+				best = scores[i];
+			}
+		}
+
+		reportProgress(best);
+	}
+
+	setStopReason(StopReasonGridComplete);
 }
 
 void RefinementGridSearch::refine()
@@ -99,26 +142,51 @@ void RefinementGridSearch::refine()
     
     csv->addHeader("result");
     
-    recursiveEvaluation(currentValues, ParamList(), &results);
+    evaluateGrid(currentValues);
 
-    double minResult = (*evaluationFunction)(evaluateObject);
+    double minResult = evaluate(evaluateObject);
     ParamList minParams;
 	bool changed = false;
+	size_t minIndex = 0;
 
-    for (ResultMap::iterator it = results.begin(); it != results.end(); it++)
-    {
-        if (it->second < minResult)
-        {
-            minResult = it->second;
-            minParams = it->first;
+	for (size_t i = 0; i < _gridResults.size(); i++)
+	{
+		if (_gridResults[i] < minResult)
+		{
+			minResult = _gridResults[i];
+			minIndex = i;
 			changed = true;
-        }
-        
-        std::vector<double> result = it->first;
-        result.push_back(it->second);
-        
-        csv->addEntry(result);
-    }
+		}
+	}
+
+	if (changed)
+	{
+		gridPoint(minIndex, currentValues, &minParams);
+	}
+
+	/* The full tables are only kept when someone will look at them */
+	if (_writeCSV)
+	{
+		ParamList values;
+
+		for (size_t i = 0; i < _gridResults.size(); i++)
+		{
+			if (_gridResults[i] != _gridResults[i])
+			{
+				continue;
+			}
+
+			gridPoint(i, currentValues, &values);
+			results[values] = _gridResults[i];
+			reverseResults[_gridResults[i]] = values;
+			orderedParams.push_back(values);
+			orderedResults.push_back(_gridResults[i]);
+
+			std::vector<double> result = values;
+			result.push_back(_gridResults[i]);
+			csv->addEntry(result);
+		}
+	}
 
 	for (size_t i = 0; i < minParams.size(); i++)
 	{
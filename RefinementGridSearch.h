@@ -53,6 +53,16 @@ private:
     std::vector<ParamList> orderedParams;
 	static int _refine_counter; /* thread care! */
 
+	/* grid offsets (in units of otherValues) of the first point and the
+	 * number of points, per parameter */
+	std::vector<int> _gridStart;
+	std::vector<int> _gridCount;
+	std::vector<double> _gridResults;
+
+	size_t prepareGrid();
+	void gridPoint(size_t index, ParamList &reference, ParamList *values);
+	void evaluateGrid(ParamList &reference);
+
 public:
     RefinementGridSearch() : RefinementStrategy()
     {
@@ -73,7 +83,6 @@ public:
     }
     
     ResultMap results;
-    void recursiveEvaluation(ParamList referenceList, ParamList workingList, ResultMap *results);
 
 	std::vector<double> getNextResult(int num)
 	{
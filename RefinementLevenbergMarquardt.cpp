@@ -0,0 +1,418 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "RefinementLevenbergMarquardt.h"
+#include <iostream>
+#include <iomanip>
+#include <math.h>
+#include <algorithm>
+
+#define MAX_DAMPING 1e12
+
+/* Gauss-Jordan inversion with partial pivoting of an n x n matrix. The
+ * normal equations are small (one row per parameter), so this is cheap. */
+static bool invertMatrix(std::vector<double> matrix, size_t n,
+                         std::vector<double> *inverse)
+{
+	inverse->assign(n * n, 0);
+
+	for (size_t i = 0; i < n; i++)
+	{
+		(*inverse)[i * n + i] = 1;
+	}
+
+	for (size_t col = 0; col < n; col++)
+	{
+		size_t pivot = col;
+
+		for (size_t row = col + 1; row < n; row++)
+		{
+			if (fabs(matrix[row * n + col]) > fabs(matrix[pivot * n + col]))
+			{
+				pivot = row;
+			}
+		}
+
+		if (!(fabs(matrix[pivot * n + col]) > 1e-300))
+		{
+			return false;
+		}
+
+		for (size_t k = 0; k < n; k++)
+		{
+			std::swap(matrix[col * n + k], matrix[pivot * n + k]);
+			std::swap((*inverse)[col * n + k], (*inverse)[pivot * n + k]);
+		}
+
+		double scale = 1 / matrix[col * n + col];
+
+		for (size_t k = 0; k < n; k++)
+		{
+			matrix[col * n + k] *= scale;
+			(*inverse)[col * n + k] *= scale;
+		}
+
+		for (size_t row = 0; row < n; row++)
+		{
+			double factor = matrix[row * n + col];
+
+			if (row == col || factor == 0)
+			{
+				continue;
+			}
+
+			for (size_t k = 0; k < n; k++)
+			{
+				matrix[row * n + k] -= factor * matrix[col * n + k];
+				(*inverse)[row * n + k] -= factor * (*inverse)[col * n + k];
+			}
+		}
+	}
+
+	return true;
+}
+
+void RefinementLevenbergMarquardt::addDerivedParameter(void *object,
+                                                       Getter getter,
+                                                       Setter setter,
+                                                       ResidualFunction
+                                                       derivative,
+                                                       double stepSize,
+                                                       double convergence,
+                                                       std::string tag)
+{
+	_derivatives.resize(objects.size(), NULL);
+	addParameter(object, getter, setter, stepSize, convergence, tag);
+	_derivatives.push_back(derivative);
+}
+
+void RefinementLevenbergMarquardt::clearParameters()
+{
+	RefinementStrategy::clearParameters();
+
+	_derivatives.clear();
+	_uncertainties.clear();
+}
+
+double RefinementLevenbergMarquardt::sumOfSquares(std::vector<double> &residuals)
+{
+	double sum = 0;
+
+	for (size_t j = 0; j < residuals.size(); j++)
+	{
+		sum += residuals[j] * residuals[j];
+	}
+
+	return sum;
+}
+
+double RefinementLevenbergMarquardt::objectiveScore()
+{
+	if (_residualFunction == NULL)
+	{
+		return RefinementStrategy::objectiveScore();
+	}
+
+	std::vector<double> residuals;
+	(*_residualFunction)(_residualObject, &residuals);
+	_evaluations++;
+
+	return sumOfSquares(residuals);
+}
+
+void RefinementLevenbergMarquardt::setParameters(std::vector<double> &values)
+{
+	for (size_t i = 0; i < objects.size(); i++)
+	{
+		(*setters[i])(objects[i], values[i]);
+	}
+}
+
+/* Column-major: the derivatives for parameter i start at i * count. */
+void RefinementLevenbergMarquardt::calculateJacobian(std::vector<double>
+                                                     *jacobian, size_t count)
+{
+	jacobian->assign(objects.size() * count, 0);
+	std::vector<double> column, plus, minus;
+
+	for (size_t i = 0; i < objects.size(); i++)
+	{
+		if (_derivatives[i] != NULL)
+		{
+			(*_derivatives[i])(objects[i], &column);
+		}
+		else
+		{
+			double value = (*getters[i])(objects[i]);
+			double delta = stepSizes[i] / 100;
+
+			(*setters[i])(objects[i], value + delta);
+			(*_residualFunction)(_residualObject, &plus);
+			_evaluations++;
+			(*setters[i])(objects[i], value - delta);
+			(*_residualFunction)(_residualObject, &minus);
+			_evaluations++;
+			(*setters[i])(objects[i], value);
+
+			column.resize(count);
+
+			for (size_t j = 0; j < count; j++)
+			{
+				column[j] = (plus[j] - minus[j]) / (2 * delta);
+			}
+		}
+
+		for (size_t j = 0; j < count && j < column.size(); j++)
+		{
+			(*jacobian)[i * count + j] = column[j];
+		}
+	}
+}
+
+void RefinementLevenbergMarquardt::normalEquations(std::vector<double>
+                                                   &jacobian,
+                                                   std::vector<double>
+                                                   &residuals,
+                                                   std::vector<double> *jtj,
+                                                   std::vector<double> *jtr)
+{
+	size_t n = objects.size();
+	size_t count = residuals.size();
+	jtj->assign(n * n, 0);
+	jtr->assign(n, 0);
+
+	for (size_t a = 0; a < n; a++)
+	{
+		const double *colA = &jacobian[a * count];
+
+		for (size_t j = 0; j < count; j++)
+		{
+			(*jtr)[a] += colA[j] * residuals[j];
+		}
+
+		for (size_t b = 0; b <= a; b++)
+		{
+			const double *colB = &jacobian[b * count];
+			double sum = 0;
+
+			for (size_t j = 0; j < count; j++)
+			{
+				sum += colA[j] * colB[j];
+			}
+
+			(*jtj)[a * n + b] = sum;
+			(*jtj)[b * n + a] = sum;
+		}
+	}
+}
+
+void RefinementLevenbergMarquardt::calculateUncertainties(std::vector<double>
+                                                          &jacobian,
+                                                          size_t count,
+                                                          double sumSquares)
+{
+	size_t n = objects.size();
+	_uncertainties.assign(n, nan(" "));
+
+	if (count <= n)
+	{
+		return;
+	}
+
+	std::vector<double> jtj, jtr, covariance;
+	std::vector<double> zeros(count, 0);
+	normalEquations(jacobian, zeros, &jtj, &jtr);
+
+	if (!invertMatrix(jtj, n, &covariance))
+	{
+		return;
+	}
+
+	double variance = sumSquares / (double)(count - n);
+
+	for (size_t i = 0; i < n; i++)
+	{
+		double diagonal = covariance[i * n + i];
+
+		if (diagonal >= 0)
+		{
+			_uncertainties[i] = sqrt(variance * diagonal);
+		}
+	}
+}
+
+void RefinementLevenbergMarquardt::reportUncertainties()
+{
+	if (_silent)
+	{
+		return;
+	}
+
+	double rad2degscale = (_toDegrees ? rad2deg(1) : 1);
+	std::cout << "Uncertainties for " << jobName << ": ";
+
+	for (size_t i = 0; i < objects.size(); i++)
+	{
+		double objectValue = (*getters[i])(objects[i]);
+		std::cout << tags[i] << "=" << objectValue * rad2degscale << " +/- "
+		<< _uncertainties[i] * rad2degscale << (_toDegrees ? "º" : "")
+		<< ", ";
+	}
+
+	std::cout << std::endl;
+}
+
+void RefinementLevenbergMarquardt::refine()
+{
+	RefinementStrategy::refine();
+
+	size_t n = objects.size();
+
+	if (n == 0)
+	{
+		return;
+	}
+
+	if (_residualFunction == NULL)
+	{
+		std::cout << "No residual function for " << jobName << std::endl;
+		finish();
+		return;
+	}
+
+	_derivatives.resize(n, NULL);
+
+	std::vector<double> values(n);
+
+	for (size_t i = 0; i < n; i++)
+	{
+		values[i] = (*getters[i])(objects[i]);
+	}
+
+	std::vector<double> residuals, trialResiduals, jacobian;
+	(*_residualFunction)(_residualObject, &residuals);
+	_evaluations++;
+	size_t count = residuals.size();
+
+	if (count == 0)
+	{
+		finish();
+		return;
+	}
+
+	double sumSquares = sumOfSquares(residuals);
+	calculateJacobian(&jacobian, count);
+
+	/* Marquardt's scaling: the damping multiplies the diagonal of J^T J,
+	 * so it is dimensionless whatever the parameters' units. */
+	std::vector<double> jtj, jtr, damped, inverse, trial(n);
+	double damping = 1e-3;
+	bool converged = false;
+	int cycle = 0;
+
+	while (cycle < maxCycles && !converged && !shouldStop())
+	{
+		normalEquations(jacobian, residuals, &jtj, &jtr);
+
+		bool accepted = false;
+
+		/* Raise the damping until a step lowers the sum of squares; a
+		 * large damping turns this into a short gradient descent step. */
+		while (!accepted && damping < MAX_DAMPING && !_cancelled)
+		{
+			damped = jtj;
+
+			for (size_t i = 0; i < n; i++)
+			{
+				damped[i * n + i] += damping * std::max(jtj[i * n + i], 1e-12);
+			}
+
+			if (!invertMatrix(damped, n, &inverse))
+			{
+				damping *= 10;
+				continue;
+			}
+
+			bool smallShifts = true;
+
+			for (size_t a = 0; a < n; a++)
+			{
+				double shift = 0;
+
+				for (size_t b = 0; b < n; b++)
+				{
+					shift -= inverse[a * n + b] * jtr[b];
+				}
+
+				trial[a] = values[a] + shift;
+
+				if (fabs(shift) >= otherValues[a])
+				{
+					smallShifts = false;
+				}
+			}
+
+			setParameters(trial);
+			(*_residualFunction)(_residualObject, &trialResiduals);
+			_evaluations++;
+			double trialSquares = sumOfSquares(trialResiduals);
+
+			if (trialSquares < sumSquares)
+			{
+				if (smallShifts)
+				{
+					setStopReason(StopReasonStepSize);
+					converged = true;
+				}
+				else if (sumSquares - trialSquares < 1e-10 * sumSquares ||
+				         scoreSettled(sumSquares, trialSquares))
+				{
+					setStopReason(StopReasonScoreChange);
+					converged = true;
+				}
+
+				accepted = true;
+				values = trial;
+				residuals = trialResiduals;
+				sumSquares = trialSquares;
+				damping = std::max(damping / 3, 1e-15);
+			}
+			else
+			{
+				damping *= 4;
+			}
+		}
+
+		setParameters(values);
+		cycle++;
+		reportProgress(sumSquares);
+
+		if (!accepted && !_cancelled)
+		{
+			setStopReason(StopReasonNoImprovement);
+			break;
+		}
+
+		calculateJacobian(&jacobian, count);
+	}
+
+	calculateUncertainties(jacobian, count, sumSquares);
+	reportUncertainties();
+
+	finish();
+}
@@ -0,0 +1,94 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __Windexing__RefinementLevenbergMarquardt__
+#define __Windexing__RefinementLevenbergMarquardt__
+
+#include "shared_ptrs.h"
+#include "RefinementStrategy.h"
+
+/* Fills in one value per observation: the residuals themselves, or the
+ * derivative of every residual with respect to one parameter. */
+typedef void (*ResidualFunction)(void *, std::vector<double> *values);
+
+/* Least-squares refinement of the residuals from setResidualFunction.
+ * Parameters added with a derivative function use it for their column
+ * of the Jacobian; any others fall back to central differences over a
+ * hundredth of their step size. Stops when every accepted shift is
+ * smaller than the parameter's convergence value, or the sum of squares
+ * has stopped falling. Progress is reported as the sum of squares. */
+
+class RefinementLevenbergMarquardt : public RefinementStrategy
+{
+private:
+    ResidualFunction _residualFunction;
+    void *_residualObject;
+    std::vector<ResidualFunction> _derivatives;
+    std::vector<double> _uncertainties;
+
+    double sumOfSquares(std::vector<double> &residuals);
+    void setParameters(std::vector<double> &values);
+    void calculateJacobian(std::vector<double> *jacobian, size_t count);
+    void normalEquations(std::vector<double> &jacobian,
+                         std::vector<double> &residuals,
+                         std::vector<double> *jtj, std::vector<double> *jtr);
+    void calculateUncertainties(std::vector<double> &jacobian,
+                                size_t count, double sumSquares);
+    void reportUncertainties();
+
+protected:
+    /* The sum of squares being minimised, rather than the evaluation
+     * function, decides whether the result is kept. */
+    virtual double objectiveScore();
+
+public:
+    RefinementLevenbergMarquardt() : RefinementStrategy()
+    {
+        _residualFunction = NULL;
+        _residualObject = NULL;
+    };
+
+    virtual ~RefinementLevenbergMarquardt() {};
+
+    void setResidualFunction(ResidualFunction function, void *object)
+    {
+        _residualFunction = function;
+        _residualObject = object;
+    }
+
+    void addDerivedParameter(void *object, Getter getter, Setter setter,
+                             ResidualFunction derivative, double stepSize,
+                             double convergence, std::string tag = "");
+
+    virtual void refine();
+    virtual void clearParameters();
+
+    /* Standard uncertainty of parameter i after refine(), from the
+     * covariance s^2 (J^T J)^-1; NaN if it could not be determined. */
+    double uncertainty(size_t i)
+    {
+        if (i >= _uncertainties.size())
+        {
+            return nan(" ");
+        }
+
+        return _uncertainties[i];
+    }
+};
+
+#endif
@@ -32,13 +32,68 @@
 //    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "RefinementNelderMead.h"
+#include "ThreadPool.h"
+#include "RefinementFixedCores.h"
 #include <algorithm>
+#include <math.h>
+#include <random>
 
-bool converged()
+/* Also records why, for finish() to report. */
+bool NelderMead::converged()
 {
+    if (shouldStop())
+    {
+        return true;
+    }
+    
+    if (testPoints.size() < 2)
+    {
+        return false;
+    }
+    
+    size_t best = 0;
+    size_t worst = 0;
+    
+    for (size_t i = 1; i < testPoints.size(); i++)
+    {
+        if (testPoints[i].second < testPoints[best].second) best = i;
+        if (testPoints[i].second > testPoints[worst].second) worst = i;
+    }
+    
+    if (scoreSettled(testPoints[worst].second, testPoints[best].second))
+    {
+        setStopReason(StopReasonScoreChange);
+        return true;
+    }
+    
+    if (simplexCollapsed(testPoints, best))
+    {
+        setStopReason(StopReasonSimplexSize);
+        return true;
+    }
+    
     return false;
 }
 
+/* Every vertex within each parameter's convergence value of the best */
+bool NelderMead::simplexCollapsed(std::vector<TestPoint> &points, size_t best)
+{
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        for (size_t j = 0; j < tags.size(); j++)
+        {
+            double diff = points[i].first[j] - points[best].first[j];
+            
+            if (!(fabs(diff) < otherValues[j]))
+            {
+                return false;
+            }
+        }
+    }
+    
+    return true;
+}
+
 void NelderMead::addPoints(std::vector<double> *point, std::vector<double> pointToAdd)
 {
     for (size_t i = 0; i < point->size(); i++)
@@ -142,11 +197,10 @@ void NelderMead::reduction()
         std::vector<double> finalVec = bestPoint.first;
         addPoints(&finalVec, diffVec);
         
-        TestPoint contractPoint = std::make_pair(finalVec, 0);
-        evaluateTestPoint(&contractPoint);
-        
-        testPoints[i] = contractPoint;
+        testPoints[i] = std::make_pair(finalVec, 0);
     }
+    
+    evaluateTestPoints(1);
 }
 
 static bool testPointWorseThanTestPoint(TestPoint one, TestPoint two)
@@ -164,10 +218,29 @@ void NelderMead::evaluateTestPoint(int num)
     evaluateTestPoint(&testPoints[num]);
 }
 
+/* Scores test points from first onwards together. */
+void NelderMead::evaluateTestPoints(size_t first)
+{
+    std::vector<std::vector<double> > points;
+    std::vector<double> scores;
+    
+    for (size_t i = first; i < testPoints.size(); i++)
+    {
+        points.push_back(testPoints[i].first);
+    }
+    
+    evaluatePoints(points, &scores);
+    
+    for (size_t i = first; i < testPoints.size(); i++)
+    {
+        testPoints[i].second = scores[i - first];
+    }
+}
+
 void NelderMead::evaluateTestPoint(TestPoint *testPoint)
 {
     setTestPointParameters(testPoint);
-    double eval = evaluationFunction(evaluateObject);
+    double eval = evaluate(evaluateObject);
     testPoint->second = eval;
 }
 
@@ -186,16 +259,8 @@ void NelderMead::clearParameters()
     testPoints.clear();
 }
 
-void NelderMead::refine()
+void NelderMead::setUpSimplex()
 {
-    RefinementStrategy::refine();
-    
-    int testPointCount = (int)tags.size() + 1;
-    testPoints.resize(testPointCount);
-    
-    if (tags.size() == 0)
-        return;
-    
     for (size_t i = 0; i < testPoints.size(); i++)
     {
         testPoints[i].second = 0;
@@ -218,17 +283,68 @@ void NelderMead::refine()
         }
     }
     
-    for (size_t i = 0; i < testPoints.size(); i++)
+    evaluateTestPoints(0);
+    _count = 0;
+}
+
+template <int N>
+void NelderMead::iterateFixed(int cycles)
+{
+    FixedSimplex<N> simplex(this, alpha, gamma, rho, sigma);
+    simplex.load(testPoints);
+    int last = std::min(_count + cycles, maxCycles);
+    
+    while (_count < last)
+    {
+        if (shouldStop())
+        {
+            break;
+        }
+        
+        if (scoreSettled(simplex.worstScore(), simplex.bestScore()))
+        {
+            setStopReason(StopReasonScoreChange);
+            break;
+        }
+        
+        if (simplex.collapsed(otherValues))
+        {
+            setStopReason(StopReasonSimplexSize);
+            break;
+        }
+        
+        _count++;
+        reportProgress(simplex.bestScore());
+        simplex.step();
+    }
+    
+    simplex.store(&testPoints);
+}
+
+/* Runs up to cycles more iterations, stopping at maxCycles overall. Small
+ * problems go to the fixed-dimension simplex, which makes the same moves
+ * without allocating. */
+void NelderMead::iterate(int cycles)
+{
+    switch (tags.size())
     {
-        evaluateTestPoint(i);
+        case 1: iterateFixed<1>(cycles); return;
+        case 2: iterateFixed<2>(cycles); return;
+        case 3: iterateFixed<3>(cycles); return;
+        case 4: iterateFixed<4>(cycles); return;
+        case 5: iterateFixed<5>(cycles); return;
+        case 6: iterateFixed<6>(cycles); return;
+        case 7: iterateFixed<7>(cycles); return;
+        case 8: iterateFixed<8>(cycles); return;
+        default: break;
     }
     
-    int count = 0;
+    int last = std::min(_count + cycles, maxCycles);
     
-    while ((!converged() && count < maxCycles))
+    while ((!converged() && _count < last && !shouldStop()))
     {
         std::vector<double> centroid = calculateCentroid();
-        count++;
+        _count++;
         
       //  if (count % skip == 0)
         {
@@ -267,6 +383,190 @@ void NelderMead::refine()
     }
     
     orderTestPoints();
+}
+
+/* Each start is a NelderMead of its own on a copy of the evaluation
+ * object, starting from a point drawn within startSpread step sizes of
+ * the current one (the first start is the current point itself). They
+ * run in rounds across the thread pool; after each round, a start whose
+ * gap to the best start exceeds its own improvement so far is dropped.
+ * Rounds keep this independent of thread timing, so one seed always
+ * gives one result. Each start also stops within a cycle of this run
+ * being cancelled or running out of time. */
+void NelderMead::multiStart()
+{
+    std::mt19937 random(_seed);
+    std::uniform_real_distribution<double> offset(-1, 1);
+    std::vector<std::vector<double> > starts(_starts);
+    
+    for (int k = 0; k < _starts; k++)
+    {
+        for (size_t j = 0; j < tags.size(); j++)
+        {
+            double value = (*getters[j])(objects[j]);
+            
+            if (k > 0)
+            {
+                value += offset(random) * _startSpread * stepSizes[j];
+            }
+            
+            starts[k].push_back(value);
+        }
+    }
+    
+    std::vector<NelderMeadPtr> simplexes;
+    std::vector<void *> copies;
+    std::vector<double> firstScores(_starts);
+    
+    for (int k = 0; k < _starts; k++)
+    {
+        void *copy = (*_cloneFunction)(evaluateObject);
+        NelderMeadPtr simplex = NelderMeadPtr(new NelderMead());
+        simplex->setEvaluationFunction(evaluationFunction, copy);
+        simplex->setCycles(maxCycles);
+        simplex->setSilent(true);
+        simplex->setScoreTolerance(_scoreTolerance);
+        simplex->setParentRun(this);
+        
+        for (size_t j = 0; j < tags.size(); j++)
+        {
+            (*setters[j])(copy, starts[k][j]);
+            simplex->addParameter(copy, getters[j], setters[j], stepSizes[j],
+                                  otherValues[j], tags[j]);
+        }
+        
+        simplex->testPoints.resize(tags.size() + 1);
+        copies.push_back(copy);
+        simplexes.push_back(simplex);
+    }
+    
+    ThreadPool::pool()->parallelFor(_starts, 1,
+    [&](size_t start, size_t end, int)
+    {
+        for (size_t k = start; k < end; k++)
+        {
+            simplexes[k]->setUpSimplex();
+            simplexes[k]->orderTestPoints();
+            firstScores[k] = simplexes[k]->testPoints[0].second;
+        }
+    });
+    
+    std::vector<int> active;
+    
+    for (int k = 0; k < _starts; k++)
+    {
+        active.push_back(k);
+    }
+    
+    int roundCycles = std::max(1, maxCycles / 5);
+    int best = 0;
+    long ownEvaluations = _evaluations;
+    
+    for (int done = 0; done < maxCycles && active.size(); done += roundCycles)
+    {
+        long evaluations = ownEvaluations;
+        
+        for (int k = 0; k < _starts; k++)
+        {
+            evaluations += simplexes[k]->evaluationCount();
+        }
+        
+        _evaluations = evaluations;
+        
+        if (shouldStop())
+        {
+            break;
+        }
+        
+        ThreadPool::pool()->parallelFor(active.size(), 1,
+        [&](size_t start, size_t end, int)
+        {
+            for (size_t i = start; i < end; i++)
+            {
+                simplexes[active[i]]->iterate(roundCycles);
+            }
+        });
+        
+        for (int k = 0; k < _starts; k++)
+        {
+            if (simplexes[k]->testPoints[0].second <
+                simplexes[best]->testPoints[0].second)
+            {
+                best = k;
+            }
+        }
+        
+        double bestScore = simplexes[best]->testPoints[0].second;
+        std::vector<int> remaining;
+        
+        for (size_t i = 0; i < active.size(); i++)
+        {
+            int k = active[i];
+            double score = simplexes[k]->testPoints[0].second;
+            
+            bool stopped = (simplexes[k]->stopReason() != StopReasonNone);
+            bool hopeless = (score - bestScore > firstScores[k] - score);
+            
+            if (!stopped && (k == best || !hopeless))
+            {
+                remaining.push_back(k);
+            }
+        }
+        
+        active = remaining;
+        setTestPointParameters(&simplexes[best]->testPoints[0]);
+        reportProgress(bestScore);
+    }
+    
+    long evaluations = ownEvaluations;
+    
+    for (int k = 0; k < _starts; k++)
+    {
+        evaluations += simplexes[k]->evaluationCount();
+    }
+    
+    _evaluations = evaluations;
+    
+    if (active.size() == 0)
+    {
+        setStopReason(simplexes[best]->stopReason());
+    }
+    
+    if (!_silent)
+    {
+        std::cout << "Best of " << _starts << " starts was start " << best
+        << std::endl;
+    }
+    
+    testPoints = simplexes[best]->testPoints;
+    setTestPointParameters(&testPoints[0]);
+    
+    for (size_t k = 0; k < copies.size(); k++)
+    {
+        (*_deleteFunction)(copies[k]);
+    }
+}
+
+void NelderMead::refine()
+{
+    RefinementStrategy::refine();
+    
+    int testPointCount = (int)tags.size() + 1;
+    testPoints.resize(testPointCount);
+    
+    if (tags.size() == 0)
+        return;
+    
+    if (_starts > 1 && canEvaluateOnClones())
+    {
+        multiStart();
+    }
+    else
+    {
+        setUpSimplex();
+        iterate(maxCycles);
+    }
+    
     reportProgress(testPoints[0].second);
     setTestPointParameters(&testPoints[0]);
     
@@ -275,6 +575,10 @@ void NelderMead::refine()
 
 void NelderMead::init()
 {
+    _starts = 1;
+    _startSpread = 10;
+    _seed = 0;
+    _count = 0;
     alpha = 1;
     gamma = 2;
     rho = -0.5;
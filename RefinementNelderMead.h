@@ -49,12 +49,17 @@ private:
     double sigma;
     
     std::vector<TestPoint> testPoints;
+    int _count;
+    int _starts;
+    double _startSpread;
+    unsigned int _seed;
     
     void setWorstTestPoint(TestPoint &newPoint);
     TestPoint *worstTestPoint();
     void orderTestPoints();
     void evaluateTestPoint(int num);
     void evaluateTestPoint(TestPoint *testPoint);
+    void evaluateTestPoints(size_t first);
     void setTestPointParameters(TestPoint *testPoint);
     std::vector<double> calculateCentroid();
     
@@ -67,12 +72,33 @@ private:
     void addPoints(std::vector<double> *point, std::vector<double> pointToAdd);
     void scalePoint(std::vector<double> *point, double scale);
     void subtractPoints(std::vector<double> *point, std::vector<double> pointToSubtract);
+    
+    bool converged();
+    bool simplexCollapsed(std::vector<TestPoint> &points, size_t best);
+    void setUpSimplex();
+    void iterate(int cycles);
+    template <int N> void iterateFixed(int cycles);
+    void multiStart();
 public:
     void init();
     NelderMead() : RefinementStrategy() { init(); };
     virtual ~NelderMead() {};
     virtual void refine();
     
+    /* Runs several simplexes at once from random points within spread
+     * step sizes of the current values, keeping the best. Needs clone
+     * functions; the same seed gives the same result. */
+    void setMultiStart(int starts, double spread)
+    {
+        _starts = starts;
+        _startSpread = spread;
+    }
+    
+    void setSeed(unsigned int seed)
+    {
+        _seed = seed;
+    }
+    
     virtual void clearParameters();
 };
 
@@ -0,0 +1,99 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "RefinementRunner.h"
+#include "RefinementLevenbergMarquardt.h"
+#include "RefinementNelderMead.h"
+
+RefinementRunner::RefinementRunner(Crystal *crystal, QObject *parent)
+: QThread(parent), _crystal(*crystal)
+{
+	_strategy = RefinementStrategy::userChosenStrategy();
+	_strategy->setEvaluationFunction(Crystal::ewaldSphereClosenessScore,
+	                                 &_crystal);
+	_strategy->setCloneFunctions(Crystal::cloneCrystal,
+	                             Crystal::deleteCrystal);
+
+	RefinementLevenbergMarquardtPtr leastSquares;
+	leastSquares = boost::dynamic_pointer_cast<RefinementLevenbergMarquardt>
+	(_strategy);
+
+	if (leastSquares)
+	{
+		/* Picked spots only say how far each reflection is from the
+		 * sphere, and shrinking the cell pulls them all onto it, so the
+		 * cell is left alone here. */
+		_crystal.addEwaldParameters(leastSquares.get(), false, false);
+	}
+	else
+	{
+		NelderMeadPtr nelderMead;
+		nelderMead = boost::dynamic_pointer_cast<NelderMead>(_strategy);
+
+		if (nelderMead)
+		{
+			/* picked spots a degree or two off can trap a single
+			 * simplex in a local minimum */
+			nelderMead->setMultiStart(8, 15);
+			nelderMead->setSeed(1);
+		}
+
+		_strategy->addParameter(&_crystal, Crystal::getHorizontal,
+		                        Crystal::setHorizontal, 0.002, 0.0002);
+		_strategy->addParameter(&_crystal, Crystal::getVertical,
+		                        Crystal::setVertical, 0.002, 0.0002);
+	}
+
+	/* Convergence normally stops it well before these limits */
+	_strategy->setCycles(REFINEMENT_MAX_CYCLES);
+	_strategy->setTimeBudget(REFINEMENT_TIME_BUDGET);
+	_strategy->setProgressFunction(RefinementRunner::cycleDone, this,
+	                               PROGRESS_INTERVAL_MS);
+}
+
+void RefinementRunner::cancel()
+{
+	_strategy->cancel();
+}
+
+void RefinementRunner::reportCycle(int cycle, double score)
+{
+	if (_strategy->isCancelled())
+	{
+		return;
+	}
+
+	QList<double> parameters;
+	parameters.append(Crystal::getHorizontal(&_crystal));
+	parameters.append(Crystal::getVertical(&_crystal));
+
+	emit progress(cycle, score, parameters);
+}
+
+void RefinementRunner::run()
+{
+	_strategy->refine();
+
+	if (_strategy->isCancelled())
+	{
+		return;
+	}
+
+	/* folds the refined nudge into the rotation matrix */
+	_crystal.clearUpRefinement();
+}
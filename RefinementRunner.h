@@ -0,0 +1,73 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __Windexing__RefinementRunner__
+#define __Windexing__RefinementRunner__
+
+#include <QtCore/qthread.h>
+#include <QtCore/qlist.h>
+#include "Crystal.h"
+#include "RefinementStrategy.h"
+
+#define PROGRESS_INTERVAL_MS 50
+#define REFINEMENT_MAX_CYCLES 100
+#define REFINEMENT_TIME_BUDGET 10.0
+
+/* Refines a private copy of the crystal on its own thread. The window
+ * hears about it only through signals, and applies result() itself once
+ * the thread has finished. */
+
+class RefinementRunner : public QThread
+{
+    Q_OBJECT
+
+public:
+    RefinementRunner(Crystal *crystal, QObject *parent = 0);
+
+    void cancel();
+
+    bool wasCancelled()
+    {
+        return _strategy->isCancelled();
+    }
+
+    Crystal *result()
+    {
+        return &_crystal;
+    }
+
+signals:
+    /* At most every PROGRESS_INTERVAL_MS, plus once at the end */
+    void progress(int cycle, double score, QList<double> parameters);
+
+protected:
+    virtual void run();
+
+private:
+    static void cycleDone(void *runner, int cycle, double score)
+    {
+        static_cast<RefinementRunner *>(runner)->reportCycle(cycle, score);
+    }
+
+    void reportCycle(int cycle, double score);
+
+    Crystal _crystal;
+    RefinementStrategyPtr _strategy;
+};
+
+#endif
@@ -34,6 +34,7 @@
 #include "RefinementStepSearch.h"
 #include "FileReader.h"
 #include <float.h>
+#include "RefinementFixedCores.h"
 
 double RefinementStepSearch::minimizeTwoParameters(int whichParam1, int whichParam2, double *bestScore)
 {
@@ -63,23 +64,24 @@ double RefinementStepSearch::minimizeTwoParameters(int whichParam1, int whichPar
     double bestParam1 = (*getter1)(object1);
     double bestParam2 = (*getter2)(object2);
     
+    std::vector<double> current;
+    
+    for (size_t m = 0; m < objects.size(); m++)
+    {
+        current.push_back((*getters[m])(objects[m]));
+    }
+    
+    std::vector<std::vector<double> > points(9, current);
+    std::vector<double> scores;
+    
     for (double i = bestParam1 - *meanStep1; j < 3; i += *meanStep1)
     {
         int l = 0;
         
         for (double k = bestParam2 - *meanStep2; l < 3; k += *meanStep2)
         {
-            (*setter1)(object1, i);
-            (*setter2)(object2, k);
-            
-            double aScore = (*evaluationFunction)(evaluateObject);
-            
-            if (aScore != aScore)
-            {
-                aScore = FLT_MAX;
-            }
-            
-            param_scores[j * 3 + l] = aScore;
+            points[j * 3 + l][whichParam1] = i;
+            points[j * 3 + l][whichParam2] = k;
             param_trials1[j * 3 + l] = i;
             param_trials2[j * 3 + l] = k;
             
@@ -89,6 +91,21 @@ double RefinementStepSearch::minimizeTwoParameters(int whichParam1, int whichPar
         j++;
     }
     
+    /* the nine trials are independent, so they are scored together */
+    evaluatePoints(points, &scores);
+    
+    for (int i = 0; i < 9; i++)
+    {
+        double aScore = scores[i];
+        
+        if (aScore != aScore)
+        {
+            aScore = FLT_MAX;
+        }
+        
+        param_scores[i] = aScore;
+    }
+    
     for (int i = 0; i < 9; i++)
         if (param_scores[i] < param_min_score)
         {
@@ -135,7 +152,7 @@ double RefinementStepSearch::minimizeParameter(int whichParam, double *bestScore
     }
     else
     {
-        double aScore = (*evaluationFunction)(evaluateObject);
+        double aScore = evaluate(evaluateObject);
         if (aScore != aScore)
         {
             aScore = FLT_MAX;
@@ -146,11 +163,28 @@ double RefinementStepSearch::minimizeParameter(int whichParam, double *bestScore
     
     param_trials[1] = bestParam;
     
+    std::vector<double> current;
+    
+    for (size_t m = 0; m < objects.size(); m++)
+    {
+        current.push_back((*getters[m])(objects[m]));
+    }
+    
+    std::vector<std::vector<double> > points(2, current);
+    std::vector<double> scores;
+    
     for (double i = bestParam - step; j < 3; i += step * 2)
     {
-        (*setter)(object, i);
-        
-        double aScore = (*evaluationFunction)(evaluateObject);
+        points[j / 2][whichParam] = i;
+        param_trials[j] = i;
+        j += 2;
+    }
+    
+    evaluatePoints(points, &scores);
+    
+    for (j = 0; j < 3; j += 2)
+    {
+        double aScore = scores[j / 2];
         
         if (aScore != aScore)
         {
@@ -158,8 +192,6 @@ double RefinementStepSearch::minimizeParameter(int whichParam, double *bestScore
         }
         
         param_scores[j] = aScore;
-        param_trials[j] = i;
-        j += 2;
     }
     
     double param_min_score = param_scores[1];
@@ -186,10 +218,19 @@ void RefinementStepSearch::refine()
     RefinementStrategy::refine();
     
     double bestScore = FLT_MAX;
+    
+    /* NULL above MAX_FIXED_PARAMETERS */
+    FixedStepCore *fixed = makeFixedStepCore(this, objects.size());
 
     for (int i = 0; i < maxCycles; i++)
     {
+        if (shouldStop())
+        {
+            break;
+        }
+        
         bool allFinished = true;
+        double previousScore = bestScore;
         
         if (afterCycleObject && afterCycleFunction)
         {
@@ -199,30 +240,51 @@ void RefinementStepSearch::refine()
         for (size_t j = 0; j < objects.size(); j++)
         {
             bool coupled = (couplings[j] > 1);
+            bool finished = false;
             
-            if (!coupled)
+            if (!coupled && fixed)
+            {
+                finished = fixed->minimizeParameter(j, &bestScore);
+            }
+            else if (!coupled)
+            {
+                finished = minimizeParameter(j, &bestScore);
+            }
+            else if (fixed)
             {
-                allFinished *= minimizeParameter(j, &bestScore);
+                finished = fixed->minimizeTwoParameters(j, j + 1, &bestScore);
+                j++;
             }
             else
             {
-                allFinished *= minimizeTwoParameters(j, j + 1, &bestScore);
+                finished = minimizeTwoParameters(j, j + 1, &bestScore);
                 j++;
             }
+            
+            allFinished = allFinished && finished;
         }
         
         if (afterCycleObject && afterCycleFunction)
         {
             (*afterCycleFunction)(afterCycleObject);
+            releaseClones();
         }
         
         reportProgress(bestScore);
         
         if (allFinished)
         {
+            setStopReason(StopReasonStepSize);
+            break;
+        }
+        
+        if (scoreSettled(previousScore, bestScore))
+        {
+            setStopReason(StopReasonScoreChange);
             break;
         }
     }
     
+    delete fixed;
     finish();
 }
@@ -34,15 +34,18 @@
 #include "RefinementGridSearch.h"
 #include "RefinementStepSearch.h"
 #include "RefinementNelderMead.h"
+#include "RefinementLevenbergMarquardt.h"
 #include "RefinementStrategy.h"
 #include "FileReader.h"
+#include "ThreadPool.h"
 #include <iostream>
 #include <iomanip>
 
+MinimizationMethod RefinementStrategy::_chosenMethod = MinimizationMethodNelderMead;
+
 RefinementStrategyPtr RefinementStrategy::userChosenStrategy()
 {
-	int miniMethod = MinimizationMethodNelderMead;
-    MinimizationMethod method = (MinimizationMethod)miniMethod;
+    MinimizationMethod method = _chosenMethod;
     RefinementStrategyPtr strategy;
     
     switch (method) {
@@ -55,11 +58,15 @@ RefinementStrategyPtr RefinementStrategy::userChosenStrategy()
 		case MinimizationMethodGridSearch:
 			strategy = boost::static_pointer_cast<RefinementStrategy>(RefinementGridSearchPtr(new RefinementGridSearch()));
 			break;
+		case MinimizationMethodLevenbergMarquardt:
+			strategy = boost::static_pointer_cast<RefinementStrategy>(RefinementLevenbergMarquardtPtr(new RefinementLevenbergMarquardt()));
+			break;
         default:
             break;
     }
     
-	int cycles = 20;
+	/* a ceiling: each strategy stops earlier once converged */
+	int cycles = 100;
     strategy->setCycles(cycles);
     
     return strategy;
@@ -89,6 +96,207 @@ void RefinementStrategy::addCoupledParameter(void *object, Getter getter, Setter
     couplings.at(couplings.size() - 1)++;
 }
 
+bool RefinementStrategy::canEvaluateOnClones()
+{
+	if (_cloneFunction == NULL || _deleteFunction == NULL)
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < objects.size(); i++)
+	{
+		if (objects[i] != evaluateObject)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void RefinementStrategy::releaseClones()
+{
+	for (size_t i = 0; i < _clones.size(); i++)
+	{
+		(*_deleteFunction)(_clones[i]);
+	}
+
+	_clones.clear();
+}
+
+void RefinementStrategy::evaluatePoints(std::vector<std::vector<double> >
+                                        &points, std::vector<double> *scores)
+{
+	scores->assign(points.size(), nan(" "));
+
+	ThreadPool *pool = ThreadPool::pool();
+	int chunks = pool->chunkCount(points.size(), 1);
+
+	if (chunks <= 1 || !canEvaluateOnClones())
+	{
+		std::vector<double> original;
+
+		for (size_t j = 0; j < objects.size(); j++)
+		{
+			original.push_back((*getters[j])(objects[j]));
+		}
+
+		for (size_t i = 0; i < points.size() && !_cancelled; i++)
+		{
+			for (size_t j = 0; j < objects.size(); j++)
+			{
+				(*setters[j])(objects[j], points[i][j]);
+			}
+
+			(*scores)[i] = evaluate(evaluateObject);
+		}
+
+		for (size_t j = 0; j < objects.size(); j++)
+		{
+			(*setters[j])(objects[j], original[j]);
+		}
+
+		return;
+	}
+
+	while ((int)_clones.size() < chunks)
+	{
+		_clones.push_back((*_cloneFunction)(evaluateObject));
+	}
+
+	pool->parallelFor(points.size(), 1,
+	[&](size_t start, size_t end, int chunk)
+	{
+		void *copy = _clones[chunk];
+
+		for (size_t i = start; i < end && !_cancelled; i++)
+		{
+			for (size_t j = 0; j < objects.size(); j++)
+			{
+				(*setters[j])(copy, points[i][j]);
+			}
+
+			(*scores)[i] = evaluate(copy);
+		}
+	});
+}
+
+double RefinementStrategy::evaluateAt(const double *values)
+{
+	for (size_t j = 0; j < objects.size(); j++)
+	{
+		(*setters[j])(objects[j], values[j]);
+	}
+
+	return evaluate(evaluateObject);
+}
+
+void RefinementStrategy::evaluateBatch(const double *values, size_t count,
+                                       double *scores)
+{
+	size_t n = objects.size();
+
+	if (ThreadPool::pool()->chunkCount(count, 1) > 1 && canEvaluateOnClones())
+	{
+		std::vector<std::vector<double> > points(count);
+		std::vector<double> results;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			points[i].assign(values + i * n, values + (i + 1) * n);
+		}
+
+		evaluatePoints(points, &results);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			scores[i] = results[i];
+		}
+
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		scores[i] = (_cancelled ? nan(" ") : evaluateAt(values + i * n));
+	}
+}
+
+bool RefinementStrategy::shouldStop()
+{
+	if (_cancelled)
+	{
+		setStopReason(StopReasonCancelled);
+		return true;
+	}
+
+	if (_evaluationBudget > 0 && _evaluations >= _evaluationBudget)
+	{
+		setStopReason(StopReasonEvaluations);
+		return true;
+	}
+
+	if (pastTimeBudget())
+	{
+		setStopReason(StopReasonTime);
+		return true;
+	}
+
+	if (_parentRun && _parentRun->_cancelled)
+	{
+		setStopReason(StopReasonCancelled);
+		return true;
+	}
+
+	if (_parentRun && _parentRun->pastTimeBudget())
+	{
+		setStopReason(StopReasonTime);
+		return true;
+	}
+
+	return false;
+}
+
+bool RefinementStrategy::pastTimeBudget() const
+{
+	if (_timeBudget <= 0)
+	{
+		return false;
+	}
+
+	std::chrono::duration<double> elapsed;
+	elapsed = std::chrono::steady_clock::now() - _startTime;
+
+	return (elapsed.count() >= _timeBudget);
+}
+
+bool RefinementStrategy::scoreSettled(double previous, double current)
+{
+	if (_scoreTolerance <= 0 || previous != previous || current != current)
+	{
+		return false;
+	}
+
+	return (fabs(previous - current) <= _scoreTolerance * fabs(previous));
+}
+
+std::string RefinementStrategy::stopReasonName(StopReason reason)
+{
+	switch (reason)
+	{
+		case StopReasonCycles: return "cycle limit";
+		case StopReasonSimplexSize: return "simplex converged";
+		case StopReasonScoreChange: return "score settled";
+		case StopReasonStepSize: return "steps below convergence";
+		case StopReasonNoImprovement: return "no further improvement";
+		case StopReasonGridComplete: return "grid complete";
+		case StopReasonEvaluations: return "evaluation budget";
+		case StopReasonTime: return "time budget";
+		case StopReasonCancelled: return "cancelled";
+		default: return "not run";
+	}
+}
+
 void RefinementStrategy::refine()
 {
     if (!jobName.length())
@@ -104,8 +312,10 @@ void RefinementStrategy::refine()
         return;
     }
 
-	
-    startingScore = (*evaluationFunction)(evaluateObject);
+	_evaluations = 0;
+	_stopReason = StopReasonNone;
+	_startTime = std::chrono::steady_clock::now();
+    startingScore = objectiveScore();
 
     for (size_t i = 0; i < objects.size(); i++)
     {
@@ -118,8 +328,11 @@ void RefinementStrategy::refine()
 
 void RefinementStrategy::reportProgress(double score)
 {
+	notifyProgress(score, false);
+
 	if (!_verbose || _silent)
 	{
+		cycleNum++;
 		return;
 	}
 
@@ -137,9 +350,32 @@ void RefinementStrategy::reportProgress(double score)
     cycleNum++;
 }
 
+void RefinementStrategy::notifyProgress(double score, bool force)
+{
+	if (_progressFunction == NULL)
+	{
+		return;
+	}
+
+	std::chrono::steady_clock::time_point now;
+	now = std::chrono::steady_clock::now();
+	std::chrono::milliseconds interval(_progressInterval);
+
+	if (!force && now - _lastProgress < interval)
+	{
+		return;
+	}
+
+	_lastProgress = now;
+	(*_progressFunction)(_progressObject, cycleNum, score);
+}
+
 void RefinementStrategy::finish()
 {
-    double endScore = (*evaluationFunction)(evaluateObject);
+	releaseClones();
+
+    setStopReason(StopReasonCycles);
+    double endScore = objectiveScore();
 
     if (endScore >= startingScore || endScore != endScore)
     {
@@ -190,6 +426,18 @@ void RefinementStrategy::finish()
 		_changed = 1;
     }
 
+	if (!_silent)
+	{
+		std::chrono::duration<double> elapsed;
+		elapsed = std::chrono::steady_clock::now() - _startTime;
+
+		std::cout << "Stopped on " << stopReasonName(_stopReason) << " after "
+		<< _evaluations << " evaluations (" << elapsed.count() << " s)."
+		<< std::endl;
+	}
+
+	notifyProgress((_changed == 1) ? endScore : startingScore, true);
+
     cycleNum = 0;
 
 	if (finishFunction != NULL)
@@ -39,17 +39,41 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <atomic>
+#include <chrono>
 
 typedef enum
 {
 	MinimizationMethodStepSearch = 0,
 	MinimizationMethodNelderMead = 1,
 	MinimizationMethodGridSearch = 2,
+	MinimizationMethodLevenbergMarquardt = 3,
 } MinimizationMethod;
 
 
+/* Why the last refine() stopped */
+typedef enum
+{
+	StopReasonNone = 0,
+	StopReasonCycles,
+	StopReasonSimplexSize,
+	StopReasonScoreChange,
+	StopReasonStepSize,
+	StopReasonNoImprovement,
+	StopReasonGridComplete,
+	StopReasonEvaluations,
+	StopReasonTime,
+	StopReasonCancelled,
+} StopReason;
+
 typedef double (*Getter)(void *);
 typedef void (*Setter)(void *, double newValue);
+typedef void (*ProgressFunction)(void *, int cycle, double score);
+typedef void *(*CloneFunction)(void *);
+typedef void (*DeleteFunction)(void *);
+
+template <int N> class FixedSimplex;
+template <int N> class FixedStepSearch;
 
 class RefinementStrategy
 {
@@ -75,8 +99,83 @@ protected:
     std::vector<double> startingValues;
     double startingScore;
 	bool _verbose;
+	std::atomic<bool> _cancelled;
+	ProgressFunction _progressFunction;
+	void *_progressObject;
+	int _progressInterval;
+	std::chrono::steady_clock::time_point _lastProgress;
+	static MinimizationMethod _chosenMethod;
+	CloneFunction _cloneFunction;
+	DeleteFunction _deleteFunction;
+	std::vector<void *> _clones;
+
+	bool canEvaluateOnClones();
+
+	/* Scores independent candidates, each holding one value for every
+	 * parameter in the order added. With clone functions and more than
+	 * one thread, the candidates are shared out over the thread pool,
+	 * each thread scoring on its own copy of the evaluation object; the
+	 * copies are kept until finish() or releaseClones(). Otherwise they
+	 * are scored here in turn. The parameters are left as they were. */
+	void evaluatePoints(std::vector<std::vector<double> > &points,
+	                    std::vector<double> *scores);
+
+	/* Call when the evaluation object changes other than through the
+	 * refined parameters, so that the copies are taken again. */
+	void releaseClones();
+
+	/* Allocation-free forms for the fixed-dimension cores: values holds
+	 * one value per parameter, and count candidates back to back for the
+	 * batch. These leave the parameters at the last candidate scored,
+	 * except when the batch goes to evaluatePoints() on the threads. */
+	double evaluateAt(const double *values);
+	void evaluateBatch(const double *values, size_t count, double *scores);
+
+	template <int N> friend class FixedSimplex;
+	template <int N> friend class FixedStepSearch;
+
+	std::atomic<long> _evaluations;
+	long _evaluationBudget;
+	double _timeBudget;
+	double _scoreTolerance;
+	std::chrono::steady_clock::time_point _startTime;
+	StopReason _stopReason;
+	RefinementStrategy *_parentRun;
+
+	bool pastTimeBudget() const;
+
+	/* Every score goes through here so that it is counted */
+	double evaluate(void *object)
+	{
+		_evaluations++;
+		return (*evaluationFunction)(object);
+	}
+
+	/* What refinement is judged on, at the start and in finish(): the
+	 * evaluation function, unless a strategy minimises something else. */
+	virtual double objectiveScore()
+	{
+		return evaluate(evaluateObject);
+	}
+
+	/* True, recording why, if cancelled or over a budget. Strategies
+	 * check this between cycles. */
+	bool shouldStop();
+
+	void setStopReason(StopReason reason)
+	{
+		if (_stopReason == StopReasonNone)
+		{
+			_stopReason = reason;
+		}
+	}
+
+	/* Relative change small enough to stop on; never true when the
+	 * score tolerance is 0. */
+	bool scoreSettled(double previous, double current);
     
     void reportProgress(double score);
+    void notifyProgress(double score, bool force);
     void finish();
 
 public:
@@ -92,12 +191,32 @@ public:
 		finishFunction = NULL;
 		_mock = false;
 		_toDegrees = false;
+		_cancelled = false;
+		_progressFunction = NULL;
+		_progressObject = NULL;
+		_progressInterval = 0;
+		_cloneFunction = NULL;
+		_deleteFunction = NULL;
+		_evaluations = 0;
+		_evaluationBudget = 0;
+		_timeBudget = 0;
+		_scoreTolerance = 0;
+		_parentRun = NULL;
+		_stopReason = StopReasonNone;
     };
 
-    virtual ~RefinementStrategy() {};
+    virtual ~RefinementStrategy()
+    {
+        releaseClones();
+    };
     
     static RefinementStrategyPtr userChosenStrategy();
 
+	static void setUserChosenMethod(MinimizationMethod method)
+	{
+		_chosenMethod = method;
+	}
+
 	void reportInDegrees()
 	{
 		_toDegrees = true;
@@ -119,6 +238,40 @@ public:
 		finishFunction = finishFunc;
 	}
 
+	/* Lets strategies evaluate on private copies of the evaluation
+	 * object from several threads. Only used when every parameter
+	 * belongs to the evaluation object itself. */
+	void setCloneFunctions(CloneFunction clone, DeleteFunction destroy)
+	{
+		_cloneFunction = clone;
+		_deleteFunction = destroy;
+	}
+
+	/* Observer for drawing or reporting: called with the best score so
+	 * far at the end of a cycle, no more often than every intervalMs, and
+	 * once more when refinement finishes. Kept apart from the evaluation
+	 * function, which should stay free of side effects. */
+	void setProgressFunction(ProgressFunction function, void *object,
+	                         int intervalMs = 0)
+	{
+		_progressFunction = function;
+		_progressObject = object;
+		_progressInterval = intervalMs;
+		_lastProgress = std::chrono::steady_clock::time_point();
+	}
+
+	/* May be called from another thread; refinement stops after the
+	 * current cycle. */
+	void cancel()
+	{
+		_cancelled = true;
+	}
+
+	bool isCancelled()
+	{
+		return _cancelled;
+	}
+
 	void setVerbose(bool value)
 	{
 		_verbose = value;
@@ -143,6 +296,47 @@ public:
     {
         maxCycles = num;
     }
+
+	/* Stop once this many scores have been calculated; 0 = no limit */
+	void setEvaluationBudget(long evaluations)
+	{
+		_evaluationBudget = evaluations;
+	}
+
+	/* Stop after this many seconds of refine(); 0 = no limit */
+	void setTimeBudget(double seconds)
+	{
+		_timeBudget = seconds;
+	}
+
+	/* Stop when a cycle changes the best score (or, for Nelder-Mead,
+	 * the simplex's scores differ) by less than this fraction of it.
+	 * 0 turns the test off. Parameter shifts are tested against each
+	 * parameter's convergence value (otherValue) regardless. */
+	void setScoreTolerance(double tolerance)
+	{
+		_scoreTolerance = tolerance;
+	}
+
+	StopReason stopReason()
+	{
+		return _stopReason;
+	}
+
+	/* A run made up of smaller runs hands each of them itself, so that
+	 * cancelling it or running past its time budget stops them too.
+	 * Only read from the smaller runs, so they may be on any thread. */
+	void setParentRun(RefinementStrategy *parent)
+	{
+		_parentRun = parent;
+	}
+
+	static std::string stopReasonName(StopReason reason);
+
+	long evaluationCount()
+	{
+		return _evaluations;
+	}
     
     void setJobName(std::string job)
     {
@@ -0,0 +1,243 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "ReflectionTable.h"
+#include <math.h>
+
+VECTOR_KERNEL(check_shell_kernel,
+              (const double *m,
+               const double *__restrict rx,
+               const double *__restrict ry,
+               const double *__restrict rz,
+               double *__restrict x, double *__restrict y,
+               double *__restrict z, double *__restrict weight,
+               unsigned char *__restrict flags, size_t count,
+               double sampleZ, double minSq, double maxSq,
+               double invWavelength, double invRlpSize),
+              (m, rx, ry, rz, x, y, z, weight, flags, count, sampleZ,
+               minSq, maxSq, invWavelength, invRlpSize))
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		double a = rx[i];
+		double b = ry[i];
+		double c = rz[i];
+
+		double xx = m[0] * a + m[1] * b + m[2] * c;
+		double yy = m[3] * a + m[4] * b + m[5] * c;
+		double zz = m[6] * a + m[7] * b + m[8] * c;
+
+		x[i] = xx;
+		y[i] = yy;
+		z[i] = zz;
+
+		double dz = zz - sampleZ;
+		double sqLength = xx * xx + yy * yy + dz * dz;
+
+		double size = fabs(invWavelength - sqrt(sqLength)) * invRlpSize;
+		weight[i] = (size > 1) ? 1 : size;
+
+		unsigned char on = (sqLength >= minSq) & (sqLength <= maxSq);
+		flags[i] = (flags[i] & ~ReflectionOnImage) | on;
+	}
+}
+
+/* the row of a watched reflection which is not among the current rows */
+#define NOT_IN_TABLE ((size_t)-1)
+
+void ReflectionTable::clear()
+{
+	/* before flags goes, as it unflags the watched rows */
+	clearWatched();
+	clearRows();
+}
+
+void ReflectionTable::clearRows()
+{
+	for (size_t j = 0; j < _watched.size(); j++)
+	{
+		_watched[j] = NOT_IN_TABLE;
+	}
+
+	h.clear(); k.clear(); l.clear();
+	rx.clear(); ry.clear(); rz.clear();
+	x.clear(); y.clear(); z.clear();
+	weight.clear();
+	flags.clear();
+}
+
+void ReflectionTable::reserve(size_t count)
+{
+	h.reserve(count); k.reserve(count); l.reserve(count);
+	rx.reserve(count); ry.reserve(count); rz.reserve(count);
+	x.reserve(count); y.reserve(count); z.reserve(count);
+	weight.reserve(count);
+	flags.reserve(count);
+}
+
+void ReflectionTable::add(int _h, int _k, int _l, vec3 reciprocal)
+{
+	h.push_back(_h);
+	k.push_back(_k);
+	l.push_back(_l);
+	rx.push_back(reciprocal.x);
+	ry.push_back(reciprocal.y);
+	rz.push_back(reciprocal.z);
+	x.push_back(reciprocal.x);
+	y.push_back(reciprocal.y);
+	z.push_back(reciprocal.z);
+	weight.push_back(0);
+	flags.push_back(0);
+}
+
+void ReflectionTable::append(ReflectionTable &other)
+{
+	h.insert(h.end(), other.h.begin(), other.h.end());
+	k.insert(k.end(), other.k.begin(), other.k.end());
+	l.insert(l.end(), other.l.begin(), other.l.end());
+	rx.insert(rx.end(), other.rx.begin(), other.rx.end());
+	ry.insert(ry.end(), other.ry.begin(), other.ry.end());
+	rz.insert(rz.end(), other.rz.begin(), other.rz.end());
+	x.insert(x.end(), other.x.begin(), other.x.end());
+	y.insert(y.end(), other.y.begin(), other.y.end());
+	z.insert(z.end(), other.z.begin(), other.z.end());
+	weight.insert(weight.end(), other.weight.begin(), other.weight.end());
+	flags.insert(flags.end(), other.flags.begin(), other.flags.end());
+}
+
+void ReflectionTable::checkShell(mat3x3 &transform, double wavelength,
+                                 double rlpSize, size_t start, size_t end)
+{
+	if (end <= start)
+	{
+		return;
+	}
+
+	double minLength = 1 / wavelength - rlpSize;
+	double maxLength = 1 / wavelength + rlpSize;
+
+	check_shell_kernel(transform.vals, &rx[start], &ry[start], &rz[start],
+	                   &x[start], &y[start], &z[start], &weight[start],
+	                   &flags[start], end - start, - 1 / wavelength,
+	                   minLength * minLength, maxLength * maxLength,
+	                   1 / wavelength, 1 / rlpSize);
+}
+
+void ReflectionTable::toggleWatched(size_t i)
+{
+	flags[i] ^= ReflectionWatched;
+
+	if (flags[i] & ReflectionWatched)
+	{
+		_watched.push_back(i);
+		_watchedX.push_back(h[i]);
+		_watchedY.push_back(k[i]);
+		_watchedZ.push_back(l[i]);
+		return;
+	}
+
+	for (size_t j = 0; j < _watched.size(); j++)
+	{
+		if (_watched[j] != i)
+		{
+			continue;
+		}
+
+		_watched.erase(_watched.begin() + j);
+		_watchedX.erase(_watchedX.begin() + j);
+		_watchedY.erase(_watchedY.begin() + j);
+		_watchedZ.erase(_watchedZ.begin() + j);
+		return;
+	}
+}
+
+void ReflectionTable::rewatchRows(size_t start, size_t end)
+{
+	size_t missing = 0;
+
+	for (size_t j = 0; j < _watched.size(); j++)
+	{
+		missing += (_watched[j] == NOT_IN_TABLE);
+	}
+
+	for (size_t i = start; i < end && missing > 0; i++)
+	{
+		for (size_t j = 0; j < _watched.size(); j++)
+		{
+			if (_watched[j] != NOT_IN_TABLE || _watchedX[j] != h[i] ||
+			    _watchedY[j] != k[i] || _watchedZ[j] != l[i])
+			{
+				continue;
+			}
+
+			_watched[j] = i;
+			flags[i] |= ReflectionWatched;
+			missing--;
+			break;
+		}
+	}
+}
+
+void ReflectionTable::clearWatched()
+{
+	for (size_t j = 0; j < _watched.size(); j++)
+	{
+		if (_watched[j] != NOT_IN_TABLE)
+		{
+			flags[_watched[j]] &= ~ReflectionWatched;
+		}
+	}
+
+	_watched.clear();
+	_watchedX.clear();
+	_watchedY.clear();
+	_watchedZ.clear();
+}
+
+/* Only the handful of watched reflections are transformed, so a trial
+ * nudge costs microseconds however large the table is. */
+double ReflectionTable::watchedCloseness(mat3x3 &transform, double wavelength,
+                                         double rlpSize) const
+{
+	size_t count = _watched.size();
+
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	const double *m = transform.vals;
+	const double *wx = &_watchedX[0];
+	const double *wy = &_watchedY[0];
+	const double *wz = &_watchedZ[0];
+	double sampleZ = - 1 / wavelength;
+	double sizeSum = 0;
+
+	for (size_t j = 0; j < count; j++)
+	{
+		double xx = m[0] * wx[j] + m[1] * wy[j] + m[2] * wz[j];
+		double yy = m[3] * wx[j] + m[4] * wy[j] + m[5] * wz[j];
+		double zz = m[6] * wx[j] + m[7] * wy[j] + m[8] * wz[j] - sampleZ;
+		double length = sqrt(xx * xx + yy * yy + zz * zz);
+
+		double size = fabs(1 / wavelength - length) / rlpSize;
+		sizeSum += (size > 1) ? 1 : size;
+	}
+
+	return sizeSum / (double)count;
+}
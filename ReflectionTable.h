@@ -0,0 +1,147 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __Windexing__ReflectionTable__
+#define __Windexing__ReflectionTable__
+
+#include <vector>
+#include "mat3x3.h"
+
+/* Declares a static vector kernel with an AVX2 build and a baseline
+ * build, picked on the running CPU:
+ *
+ *   VECTOR_KERNEL(scale_kernel, (double *x, size_t n), (x, n))
+ *   {
+ *       for (size_t i = 0; i < n; i++) x[i] *= 2;
+ *   }
+ *
+ * GCC on x86-64 Linux clones it with target_clones and the loader picks
+ * a clone. clang has no usable target_clones on macOS (no ifunc), so
+ * there both builds are generated explicitly and a cpuid check on the
+ * first call picks one; defining VECTOR_MANUAL_DISPATCH forces this
+ * path elsewhere. Other CPUs (e.g. NEON on arm64) get the baseline
+ * vector unit only. */
+#if defined(__x86_64__) && (defined(__clang__) || defined(__APPLE__))
+#define VECTOR_MANUAL_DISPATCH
+#endif
+
+#if defined(__x86_64__) && defined(VECTOR_MANUAL_DISPATCH)
+#define VECTOR_KERNEL(name, params, args) \
+	static inline __attribute__((always_inline)) void name##_body params; \
+	__attribute__((target("avx2"))) static void name##_avx2 params \
+	{ name##_body args; } \
+	static void name##_baseline params \
+	{ name##_body args; } \
+	static void name params \
+	{ \
+		static void (*chosen) params = __builtin_cpu_supports("avx2") ? \
+		                               name##_avx2 : name##_baseline; \
+		chosen args; \
+	} \
+	static inline __attribute__((always_inline)) void name##_body params
+#elif defined(__GNUC__) && defined(__x86_64__)
+#define VECTOR_KERNEL(name, params, args) \
+	__attribute__((target_clones("avx2", "default"))) \
+	static void name params
+#else
+#define VECTOR_KERNEL(name, params, args) \
+	static void name params
+#endif
+
+typedef enum
+{
+	ReflectionOnImage = 1,
+	ReflectionWatched = 2,
+} ReflectionFlag;
+
+/* Reflections stored as separate contiguous arrays, so that the shell
+ * check streams through memory and can be vectorised. */
+
+class ReflectionTable
+{
+public:
+	void clear();
+
+	/* Drops every row but keeps the watched Miller indices, which
+	 * rewatchRows flags again wherever rows start to end hold them. */
+	void clearRows();
+	void rewatchRows(size_t start, size_t end);
+
+	void reserve(size_t count);
+	void add(int h, int k, int l, vec3 reciprocal);
+	void append(ReflectionTable &other);
+
+	/* Applies one matrix to the unrotated reciprocal coordinates of
+	 * reflections start to end and classifies them against the shell of
+	 * the Ewald sphere (1 / wavelength +/- rlpSize). */
+	void checkShell(mat3x3 &transform, double wavelength, double rlpSize,
+	                size_t start, size_t end);
+
+	/* Watching keeps a small copy of the reflection's Miller indices,
+	 * so that refinement never touches the full table. */
+	void toggleWatched(size_t i);
+	void clearWatched();
+
+	size_t watchedCount() const
+	{
+		return _watched.size();
+	}
+
+	vec3 watchedMiller(size_t j) const
+	{
+		return make_vec3(_watchedX[j], _watchedY[j], _watchedZ[j]);
+	}
+
+	/* Mean weight of the watched reflections, with transform taking
+	 * Miller indices to rotated reciprocal space, leaving the table
+	 * untouched. 0 if none are watched. */
+	double watchedCloseness(mat3x3 &transform, double wavelength,
+	                        double rlpSize) const;
+
+	size_t size() const
+	{
+		return h.size();
+	}
+
+	bool hasFlag(size_t i, ReflectionFlag flag)
+	{
+		return (flags[i] & flag);
+	}
+
+	/* integer Miller indices */
+	std::vector<int> h, k, l;
+
+	/* unit-cell transformed, before rotation */
+	std::vector<double> rx, ry, rz;
+
+	/* after rotation and nudge */
+	std::vector<double> x, y, z;
+
+	/* proportional to distance from the Ewald sphere, 0 to 1 */
+	std::vector<double> weight;
+
+	std::vector<unsigned char> flags;
+
+private:
+	/* indices into the table, with their Miller indices; a watched
+	 * reflection outside the current rows keeps only the latter */
+	std::vector<size_t> _watched;
+	std::vector<double> _watchedX, _watchedY, _watchedZ;
+};
+
+#endif
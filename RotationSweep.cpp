@@ -0,0 +1,188 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "RotationSweep.h"
+#include "Crystal.h"
+#include "Detector.h"
+#include "ReflectionTable.h"
+#include "ThreadPool.h"
+#include "shared_ptrs.h"
+#include <algorithm>
+
+RotationSweep::RotationSweep(Crystal *crystal, Detector *detector)
+{
+	_crystal = crystal;
+	_detector = detector;
+	_axis = make_vec3(1, 0, 0);
+	_phiStart = 0;
+	_phiEnd = 1;
+	_wavelength = 1;
+}
+
+/* Rotating q by phi about the unit axis e gives
+ *   p = (q.e) e + (q - (q.e) e) cos phi + (e x q) sin phi,
+ * and p lies on the sphere when p_z = -wavelength |q|^2 / 2. Only the z
+ * component matters, so this is b cos phi + c sin phi = d, with up to
+ * two solutions per turn. */
+int RotationSweep::crossings(vec3 q, double *phis)
+{
+	double along = vec3_dot_vec3(q, _axis);
+	double a = along * _axis.z;
+	double b = q.z - a;
+	double c = _axis.x * q.y - _axis.y * q.x;
+	double d = -_wavelength * vec3_sqlength(q) / 2 - a;
+	double r = sqrt(b * b + c * c);
+
+	if (r <= 0 || fabs(d) > r)
+	{
+		return 0;
+	}
+
+	double centre = atan2(c, b);
+	double spread = acos(d / r);
+	double start = deg2rad(_phiStart);
+	double end = deg2rad(std::min(_phiEnd, _phiStart + 360));
+	double tries[2] = {centre - spread, centre + spread};
+	int count = 0;
+
+	for (int i = 0; i < 2; i++)
+	{
+		/* tangent crossings are reported once */
+		if (i == 1 && spread <= 0)
+		{
+			break;
+		}
+
+		double phi = fmod(tries[i] - start, 2 * M_PI);
+
+		if (phi < 0)
+		{
+			phi += 2 * M_PI;
+		}
+
+		phi += start;
+
+		if (phi <= end)
+		{
+			phis[count] = phi;
+			count++;
+		}
+	}
+
+	if (count == 2 && phis[1] < phis[0])
+	{
+		std::swap(phis[0], phis[1]);
+	}
+
+	return count;
+}
+
+size_t RotationSweep::predict(std::vector<SweepPrediction> *predictions)
+{
+	predictions->clear();
+
+	if (_phiEnd <= _phiStart)
+	{
+		return 0;
+	}
+
+	_wavelength = _detector->getWavelength();
+
+	ReflectionTable lattice;
+	_crystal->populateLattice(&lattice);
+	mat3x3 rotation = _crystal->getRotation();
+
+	ThreadPool *pool = ThreadPool::pool();
+	std::vector<std::vector<SweepPrediction> > chunks;
+	chunks.resize(pool->chunkCount(lattice.size(), 4096));
+
+	pool->parallelFor(lattice.size(), 4096,
+	[&](size_t start, size_t end, int chunk)
+	{
+		std::vector<SweepPrediction> *part = &chunks[chunk];
+		std::vector<double> xs, ys, zs;
+
+		for (size_t i = start; i < end; i++)
+		{
+			vec3 q = make_vec3(lattice.rx[i], lattice.ry[i], lattice.rz[i]);
+			mat3x3_mult_vec(rotation, &q);
+
+			double phis[2];
+			int count = crossings(q, phis);
+
+			for (int j = 0; j < count; j++)
+			{
+				double cosPhi = cos(phis[j]);
+				double sinPhi = sin(phis[j]);
+				double along = vec3_dot_vec3(q, _axis);
+				vec3 cross = vec3_cross_vec3(_axis, q);
+
+				vec3 parallel = _axis;
+				vec3_mult(&parallel, along * (1 - cosPhi));
+				vec3 straight = q;
+				vec3_mult(&straight, cosPhi);
+				vec3_mult(&cross, sinPhi);
+				vec3 p = vec3_add_vec3(straight, cross);
+				p = vec3_add_vec3(p, parallel);
+
+				SweepPrediction prediction;
+				prediction.h = lattice.h[i];
+				prediction.k = lattice.k[i];
+				prediction.l = lattice.l[i];
+				prediction.phi = rad2deg(phis[j]);
+				part->push_back(prediction);
+				xs.push_back(p.x);
+				ys.push_back(p.y);
+				zs.push_back(p.z);
+			}
+		}
+
+		/* The whole chunk's crossings go to the detector in one batch;
+		 * those missing it (or every panel) are dropped. */
+		size_t n = part->size();
+		std::vector<double> px(n), py(n);
+		std::vector<unsigned char> hit(n);
+		_detector->locate(xs.data(), ys.data(), zs.data(), n,
+		                  px.data(), py.data(), hit.data());
+
+		size_t kept = 0;
+
+		for (size_t i = 0; i < n; i++)
+		{
+			if (!hit[i])
+			{
+				continue;
+			}
+
+			(*part)[kept] = (*part)[i];
+			(*part)[kept].x = px[i];
+			(*part)[kept].y = py[i];
+			kept++;
+		}
+
+		part->resize(kept);
+	});
+
+	for (size_t i = 0; i < chunks.size(); i++)
+	{
+		predictions->insert(predictions->end(), chunks[i].begin(),
+		                    chunks[i].end());
+	}
+
+	return predictions->size();
+}
@@ -0,0 +1,74 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __Windexing__RotationSweep__
+#define __Windexing__RotationSweep__
+
+#include <vector>
+#include "mat3x3.h"
+
+class Crystal;
+class Detector;
+
+typedef struct
+{
+	int h, k, l;
+	double phi; // degrees from the current orientation
+	double x, y; // detector position, relative to beam centre
+} SweepPrediction;
+
+/* Predicts every reflection recorded while the crystal turns about a
+ * spindle axis, by solving for the angles at which each lattice point
+ * crosses the Ewald sphere rather than stepping through the rotation.
+ * Phi follows the right hand rule about the axis, and 0 is the crystal's
+ * present orientation. */
+
+class RotationSweep
+{
+public:
+	RotationSweep(Crystal *crystal, Detector *detector);
+
+	void setAxis(vec3 axis)
+	{
+		_axis = axis;
+		vec3_set_length(&_axis, 1);
+	}
+
+	/* Ranges longer than a full turn are cut to one. */
+	void setRange(double phiStart, double phiEnd)
+	{
+		_phiStart = phiStart;
+		_phiEnd = phiEnd;
+	}
+
+	/* Fills predictions in lattice order, each reflection contributing
+	 * up to two crossings. Returns the number found. */
+	size_t predict(std::vector<SweepPrediction> *predictions);
+
+private:
+	int crossings(vec3 q, double *phis);
+
+	Crystal *_crystal;
+	Detector *_detector;
+	vec3 _axis;
+	double _phiStart;
+	double _phiEnd;
+	double _wavelength;
+};
+
+#endif
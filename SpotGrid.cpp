@@ -0,0 +1,165 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "SpotGrid.h"
+#include <math.h>
+#include <float.h>
+
+SpotGrid::SpotGrid()
+{
+	clear();
+}
+
+void SpotGrid::clear()
+{
+	_minX = 0;
+	_minY = 0;
+	_cellSize = 1;
+	_reach = 0;
+	_cellsX = 0;
+	_cellsY = 0;
+	_cellStart.clear();
+	_xs.clear();
+	_ys.clear();
+	_refls.clear();
+}
+
+void SpotGrid::build(std::vector<double> &xs, std::vector<double> &ys,
+                     std::vector<int> &refls, double reach)
+{
+	clear();
+	_reach = reach;
+	size_t count = refls.size();
+
+	if (count == 0)
+	{
+		return;
+	}
+
+	double maxX = -FLT_MAX;
+	double maxY = -FLT_MAX;
+	_minX = FLT_MAX;
+	_minY = FLT_MAX;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (xs[i] < _minX) _minX = xs[i];
+		if (ys[i] < _minY) _minY = ys[i];
+		if (xs[i] > maxX) maxX = xs[i];
+		if (ys[i] > maxY) maxY = ys[i];
+	}
+
+	/* Buckets no smaller than the click reach, and no more of them
+	 * than about two per spot, however spread out the spots are. */
+	double width = maxX - _minX + 1;
+	double height = maxY - _minY + 1;
+	_cellSize = reach * 2;
+	double fill = sqrt(width * height / (2 * count));
+
+	if (fill > _cellSize)
+	{
+		_cellSize = fill;
+	}
+
+	while ((width / _cellSize + 1) * (height / _cellSize + 1) > 4 * count + 16)
+	{
+		_cellSize *= 2;
+	}
+
+	_cellsX = width / _cellSize + 1;
+	_cellsY = height / _cellSize + 1;
+
+	std::vector<int> cells(count);
+	_cellStart.resize(_cellsX * _cellsY + 1, 0);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		int cx = (xs[i] - _minX) / _cellSize;
+		int cy = (ys[i] - _minY) / _cellSize;
+		cells[i] = cellIndex(cx, cy);
+		_cellStart[cells[i] + 1]++;
+	}
+
+	for (size_t i = 1; i < _cellStart.size(); i++)
+	{
+		_cellStart[i] += _cellStart[i - 1];
+	}
+
+	std::vector<int> fillPos(_cellStart.begin(), _cellStart.end() - 1);
+	_xs.resize(count);
+	_ys.resize(count);
+	_refls.resize(count);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		int pos = fillPos[cells[i]]++;
+		_xs[pos] = xs[i];
+		_ys[pos] = ys[i];
+		_refls[pos] = refls[i];
+	}
+}
+
+int SpotGrid::nearest(double x, double y)
+{
+	if (_refls.size() == 0)
+	{
+		return -1;
+	}
+
+	int xMin = floor((x - _reach - _minX) / _cellSize);
+	int xMax = floor((x + _reach - _minX) / _cellSize);
+	int yMin = floor((y - _reach - _minY) / _cellSize);
+	int yMax = floor((y + _reach - _minY) / _cellSize);
+
+	if (xMin < 0) xMin = 0;
+	if (yMin < 0) yMin = 0;
+	if (xMax >= _cellsX) xMax = _cellsX - 1;
+	if (yMax >= _cellsY) yMax = _cellsY - 1;
+
+	int best = -1;
+	double bestSq = FLT_MAX;
+
+	for (int cy = yMin; cy <= yMax; cy++)
+	{
+		for (int cx = xMin; cx <= xMax; cx++)
+		{
+			int cell = cellIndex(cx, cy);
+
+			for (int i = _cellStart[cell]; i < _cellStart[cell + 1]; i++)
+			{
+				double dx = _xs[i] - x;
+				double dy = _ys[i] - y;
+
+				if (fabs(dx) > _reach || fabs(dy) > _reach)
+				{
+					continue;
+				}
+
+				double sq = dx * dx + dy * dy;
+
+				if (sq < bestSq)
+				{
+					bestSq = sq;
+					best = _refls[i];
+				}
+			}
+		}
+	}
+
+	return best;
+}
@@ -0,0 +1,64 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __Windexing__SpotGrid__
+#define __Windexing__SpotGrid__
+
+#include <vector>
+#include <stddef.h>
+
+/* Uniform bucket grid over predicted spot positions on the detector.
+ * Buckets are stored back to back in one array (counting sort), so a
+ * rebuild is O(n) and a lookup only visits the few buckets in reach. */
+
+class SpotGrid
+{
+public:
+	SpotGrid();
+
+	void clear();
+
+	/* Positions of the spots to index, and their reflection numbers */
+	void build(std::vector<double> &xs, std::vector<double> &ys,
+	           std::vector<int> &refls, double reach);
+
+	/* Closest spot no further than reach along x and y, or -1 */
+	int nearest(double x, double y);
+
+	size_t spotCount()
+	{
+		return _refls.size();
+	}
+private:
+	int cellIndex(int cx, int cy)
+	{
+		return cy * _cellsX + cx;
+	}
+
+	double _minX, _minY;
+	double _cellSize;
+	double _reach;
+	int _cellsX, _cellsY;
+
+	/* bucket i holds entries _cellStart[i] to _cellStart[i + 1] */
+	std::vector<int> _cellStart;
+	std::vector<float> _xs, _ys;
+	std::vector<int> _refls;
+};
+
+#endif
@@ -0,0 +1,140 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+
+#include "StateFile.h"
+#include "Crystal.h"
+#include "Detector.h"
+#include "FileReader.h"
+#include <fstream>
+
+bool load_state_file(std::string filename, Crystal *crystal,
+                     Detector *detector, std::string *error)
+{
+	if (!file_exists(filename))
+	{
+		*error = "State file " + filename + " does not exist.";
+		return false;
+	}
+
+	std::string matrix = get_file_contents(filename);
+	std::vector<std::string> lines = split(matrix, '\n');
+
+	for (size_t i = 0; i < lines.size(); i++)
+	{
+		std::vector<std::string> components = split(lines[i], ' ');
+
+		if (components.size() == 0)
+		{
+			continue;
+		}
+
+		size_t expected = 0;
+
+		if (components[0] == "rotation" || components[0] == "unitcell")
+		{
+			expected = 9;
+		}
+		else if (components[0] == "det_centre")
+		{
+			expected = 3;
+		}
+		else if (components[0] == "wavelength" ||
+		         components[0] == "rlp_size")
+		{
+			expected = 1;
+		}
+
+		if (components.size() < expected + 1)
+		{
+			*error = "Not enough components for " + components[0] +
+			" in " + filename + ", expecting " + std::to_string(expected) +
+			" space-separated values.";
+			return false;
+		}
+
+		if (components[0] == "rotation")
+		{
+			mat3x3 rotMat = mat3x3_from_string(components);
+			crystal->setRotation(rotMat);
+		}
+
+		if (components[0] == "unitcell")
+		{
+			mat3x3 unitCell = mat3x3_from_string(components);
+			crystal->setUnitCell(unitCell);
+		}
+
+		if (components[0] == "det_centre")
+		{
+			vec3 centre = vec3_from_string(components);
+			detector->setBeamCentre(centre.x, centre.y);
+			detector->setDetectorDistance(centre.z);
+		}
+
+		if (components[0] == "wavelength")
+		{
+			double wave = atof(components[1].c_str());
+			detector->setWavelength(wave);
+			crystal->setWavelength(wave);
+		}
+
+		if (components[0] == "rlp_size")
+		{
+			double rlp_size = atof(components[1].c_str());
+			crystal->setRlpSize(rlp_size);
+		}
+	}
+
+	return true;
+}
+
+bool save_state_file(std::string filename, Crystal *crystal,
+                     Detector *detector)
+{
+	std::ofstream file;
+	file.open(filename.c_str());
+
+	if (!file.is_open())
+	{
+		return false;
+	}
+
+	mat3x3 rot = crystal->getRotation();
+	mat3x3 unitCell = crystal->getUnitCell();
+	vec3 beamCentre = detector->getBeamCentre();
+
+	file << "rotation ";
+	file << computer_friendly_desc(rot);
+
+	file << "unitcell ";
+	file << computer_friendly_desc(unitCell);
+
+	file << "det_centre ";
+	file << computer_friendly_desc(beamCentre);
+
+	file << "wavelength ";
+	file << detector->getWavelength() << std::endl;
+
+	file << "rlp_size ";
+	file << crystal->getRlpSize() << std::endl;
+
+	file.close();
+
+	return true;
+}
@@ -15,22 +15,31 @@
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 // 
 // Please email: vagabond @ hginn.co.uk for more details.
-#include "Crystal.h"
-
-typedef struct Node
-{
-	int xMin;
-	int xMax;
-	int yMin;
-	int yMax;
-	Reflection *start;
-	Node *nextNodes[4];
-	int *reflPtrs;
-	size_t nRefls;
-} Node;
-
-Node *make_node();
-void prepare_node(Node *node, Reflection *refls, int nRefls);
-void recursive_split_node(Node *node);
-void split_node(Node *node);
-void delete_node(Node *node);
+
+
+#ifndef __Windexing__StateFile__
+#define __Windexing__StateFile__
+
+#include <string>
+
+class Crystal;
+class Detector;
+
+/* The .dat state file written by Save state... and read back by both
+ * Load state... and batch prediction:
+ *
+ *   rotation <9 values>
+ *   unitcell <9 values>
+ *   det_centre <beam x> <beam y> <distance>
+ *   wavelength <value>
+ *   rlp_size <value>
+ */
+
+/* On failure, error says why and the state may be partly applied */
+bool load_state_file(std::string filename, Crystal *crystal,
+                     Detector *detector, std::string *error);
+
+bool save_state_file(std::string filename, Crystal *crystal,
+                     Detector *detector);
+
+#endif
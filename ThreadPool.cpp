@@ -0,0 +1,190 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "ThreadPool.h"
+#include <iostream>
+
+std::once_flag ThreadPool::_poolOnce;
+std::atomic<ThreadPool *> ThreadPool::_pool(NULL);
+std::atomic<int> ThreadPool::_requestedThreads(0);
+
+/* Reached from the GUI thread and the refinement threads alike, so the
+ * pool is made exactly once and never replaced while in use. */
+ThreadPool *ThreadPool::pool()
+{
+	std::call_once(_poolOnce, []()
+	{
+		int threads = _requestedThreads;
+
+		if (threads <= 0)
+		{
+			threads = std::thread::hardware_concurrency();
+		}
+
+		if (threads <= 0)
+		{
+			threads = 1;
+		}
+
+		_pool = new ThreadPool(threads);
+	});
+
+	return _pool;
+}
+
+void ThreadPool::setThreadCount(int count)
+{
+	if (_pool)
+	{
+		std::cout << "Thread pool already running with "
+		<< _pool.load()->threadCount() << " threads; ignoring request "
+		"for " << count << "." << std::endl;
+		return;
+	}
+
+	_requestedThreads = count;
+}
+
+ThreadPool::ThreadPool(int threads)
+{
+	_stopping = false;
+
+	for (int i = 1; i < threads; i++)
+	{
+		_workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+	}
+
+	std::cout << "Using " << threads << " threads." << std::endl;
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_stopping = true;
+	}
+
+	_taskReady.notify_all();
+
+	for (size_t i = 0; i < _workers.size(); i++)
+	{
+		_workers[i].join();
+	}
+}
+
+bool ThreadPool::runOneTask(std::unique_lock<std::mutex> &lock)
+{
+	if (_tasks.empty())
+	{
+		return false;
+	}
+
+	std::function<void ()> task = _tasks.front();
+	_tasks.pop_front();
+
+	lock.unlock();
+	task();
+	lock.lock();
+
+	return true;
+}
+
+void ThreadPool::workerLoop()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	while (true)
+	{
+		if (runOneTask(lock))
+		{
+			continue;
+		}
+
+		if (_stopping)
+		{
+			return;
+		}
+
+		_taskReady.wait(lock);
+	}
+}
+
+int ThreadPool::chunkCount(size_t count, size_t minChunk)
+{
+	if (minChunk == 0)
+	{
+		minChunk = 1;
+	}
+
+	size_t chunks = count / minChunk;
+	size_t maxChunks = threadCount();
+
+	if (chunks > maxChunks) chunks = maxChunks;
+	if (chunks < 1) chunks = 1;
+
+	return chunks;
+}
+
+void ThreadPool::parallelFor(size_t count, size_t minChunk, ChunkJob job)
+{
+	int chunks = chunkCount(count, minChunk);
+
+	if (chunks <= 1)
+	{
+		job(0, count, 0);
+		return;
+	}
+
+	int remaining = chunks - 1;
+
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+
+		for (int i = 1; i < chunks; i++)
+		{
+			size_t start = count * i / chunks;
+			size_t end = count * (i + 1) / chunks;
+
+			_tasks.push_back([this, &job, &remaining, start, end, i]()
+			{
+				job(start, end, i);
+
+				std::unique_lock<std::mutex> lock(_mutex);
+				remaining--;
+				_taskDone.notify_all();
+			});
+		}
+	}
+
+	_taskReady.notify_all();
+
+	job(0, count / chunks, 0);
+
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	while (remaining > 0)
+	{
+		/* help out rather than sit idle */
+		if (runOneTask(lock))
+		{
+			continue;
+		}
+
+		_taskDone.wait(lock);
+	}
+}
@@ -0,0 +1,77 @@
+// Mandexing: a manual indexing program for crystallographic data.
+// Copyright (C) 2017-2018 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __Windexing__ThreadPool__
+#define __Windexing__ThreadPool__
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+/* start, end, chunk number */
+typedef std::function<void (size_t, size_t, int)> ChunkJob;
+
+/* One shared set of worker threads. The caller of parallelFor works on
+ * chunks too while it waits, so it is safe to call from several threads
+ * at once, including from inside another parallelFor. */
+
+class ThreadPool
+{
+public:
+	static ThreadPool *pool();
+
+	/* Total threads used, including the calling thread. 0 = all cores.
+	 * Only honoured before the pool is first used. */
+	static void setThreadCount(int count);
+
+	int threadCount()
+	{
+		return _workers.size() + 1;
+	}
+
+	/* Number of chunks parallelFor would split count items into, at least
+	 * minChunk items each. Callers use this to size per-chunk buffers. */
+	int chunkCount(size_t count, size_t minChunk);
+
+	/* Runs job over [0, count) in chunkCount() contiguous chunks and
+	 * returns when all are finished. */
+	void parallelFor(size_t count, size_t minChunk, ChunkJob job);
+
+	~ThreadPool();
+private:
+	ThreadPool(int threads);
+	void workerLoop();
+	bool runOneTask(std::unique_lock<std::mutex> &lock);
+
+	std::vector<std::thread> _workers;
+	std::deque<std::function<void ()> > _tasks;
+	std::mutex _mutex;
+	std::condition_variable _taskReady;
+	std::condition_variable _taskDone;
+	bool _stopping;
+
+	static std::once_flag _poolOnce;
+	static std::atomic<ThreadPool *> _pool;
+	static std::atomic<int> _requestedThreads;
+};
+
+#endif
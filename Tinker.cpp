@@ -22,10 +22,14 @@
 #include <QtWidgets/qgraphicsitem.h>
 #include <QtWidgets/qmenubar.h>
 #include <QtWidgets/qmessagebox.h>
+#include <QtGui/qimage.h>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 #include "RefinementNelderMead.h"
 #include "FileReader.h"
+#include "StateFile.h"
+#include "ThreadPool.h"
 
 #define DEFAULT_WIDTH 1000
 #define DEFAULT_HEIGHT 800
@@ -45,6 +49,8 @@ Tinker::Tinker(QWidget *parent) : QMainWindow(parent)
 	connect(saveAs, &QAction::triggered, this, &Tinker::saveMatrix);
 	QAction *loadMatrix = fileMenu->addAction(tr("&Load state..."));
 	connect(loadMatrix, &QAction::triggered, this, &Tinker::loadMatrix);
+	QAction *loadGeom = fileMenu->addAction(tr("Load &geometry..."));
+	connect(loadGeom, &QAction::triggered, this, &Tinker::loadGeometry);
 	
 	myDialogue = NULL;
 	bUnitCell = new QPushButton("Set unit cell", this);
@@ -157,8 +163,17 @@ Tinker::Tinker(QWidget *parent) : QMainWindow(parent)
 
 
 	_refineStage = 0;
+	_refineHoriz = 0;
+	_refineVert = 0;
 	_fixAxisStage = 0;
     _identifyHklStage = 0;
+	_spotsDrawn = false;
+	_drawnDetector = 0;
+	_drawnWatch = 0;
+	_drawnRefineStage = 0;
+	_imageWidth = 0;
+	_imageHeight = 0;
+	_rawMaximum = 1;
     
 	fileDialogue = NULL;
 
@@ -170,7 +185,6 @@ Tinker::Tinker(QWidget *parent) : QMainWindow(parent)
 	
 	QBrush brush(Qt::transparent);
 	
-	_crystal.setTinker(this);
 
 	overlayView = new PredictionView(imageLabel);
 	overlay = new QGraphicsScene(overlayView);
@@ -182,6 +196,17 @@ Tinker::Tinker(QWidget *parent) : QMainWindow(parent)
 	overlayView->setStyleSheet("background-color: transparent;");
 	overlayView->setScene(overlay);
 
+	_spotItem = new PredictionOverlay();
+	overlay->addItem(_spotItem);
+
+	for (int i = 0; i < 3; i++)
+	{
+		_basisItems[i] = overlay->addLine(QLineF(), QPen(QColor(255, 0, 0)));
+	}
+
+	_fixedAxisItem = overlay->addLine(QLineF(), QPen(QColor(255, 64, 255)));
+	_fixedAxisItem->hide();
+
 	overlayView->setHorizontalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
 	overlayView->setVerticalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
 	overlayView->show();
@@ -213,6 +238,7 @@ void Tinker::resizeEvent(QResizeEvent *)
 
     imageLabel->setGeometry(left, top, w, h);
 	overlayView->setGeometry(0, 0, w, h);
+	showRawImage();
 	drawPredictions();
 }
 
@@ -343,8 +369,8 @@ void Tinker::changeBeamCentre(double deltaX, double deltaY)
 
 void Tinker::transformToDetectorCoordinates(int *x, int *y)
 {
-	double w = blankImage.width();
-	double h = blankImage.height();
+	double w = _imageWidth;
+	double h = _imageHeight;
 	double winw = overlayView->width();
 	double winh = overlayView->height();
 	
@@ -356,62 +382,69 @@ void Tinker::transformToDetectorCoordinates(int *x, int *y)
 	std::cout << *x << ", " << *y << std::endl;
 }
 
+void Tinker::layOutSpots(double w, double h, double w2, double h2,
+                         double bx, double by)
+{
+	_spotItem->clearSpots();
+	
+	const std::vector<VisibleSpot> &spots = _detector.visibleSpots();
+
+	for (size_t i = 0; i < spots.size(); i++)
+	{
+		bool watching = _crystal.isBeingWatched(spots[i].index);
+		
+		if (_refineStage != 1) watching = false;
+		
+		double x = w2 * spots[i].x / w + bx;
+		double y = h2 * spots[i].y / h + by;
+		
+		if (x < 20 || y < 20 || x > w2 - 20 || y > h2 - 20)
+		{
+			continue;
+		}
+
+		_spotItem->addSpot(x, y, spots[i].weight, watching);
+	}
+	
+	_spotItem->finishSpots();
+
+	_spotsDrawn = true;
+	_drawnDetector = _detector.generation();
+	_drawnWatch = _crystal.watchGeneration();
+	_drawnRefineStage = _refineStage;
+	_drawnView = overlay->sceneRect();
+	_drawnImage = QSize(_imageWidth, _imageHeight);
+}
+
 void Tinker::drawPredictions()
 {
-	_detector.calculatePositions();
-	qDeleteAll(overlay->items());
-	overlay->clear();
+	/* Each stage only redoes what the last change made stale */
+	_crystal.flush();
+	_detector.flush();
 	
-	double w = blankImage.width();
-	double h = blankImage.height();
+	double w = _imageWidth;
+	double h = _imageHeight;
 	double w2 = overlayView->width();
 	double h2 = overlayView->height();
 	double bx = _detector.getBeamCentre().x;
 	double by = _detector.getBeamCentre().y;
 	
 	overlay->setSceneRect(overlayView->geometry());
+	_spotItem->setBounds(overlay->sceneRect());
 	
 	bx *= w2 / w;
 	by *= h2 / h;
 	
-	int ellipseSize = 10;
+	bool stale = (!_spotsDrawn ||
+	              _drawnDetector != _detector.generation() ||
+	              _drawnWatch != _crystal.watchGeneration() ||
+	              _drawnRefineStage != _refineStage ||
+	              _drawnView != overlay->sceneRect() ||
+	              _drawnImage != QSize(_imageWidth, _imageHeight));
 	
-	for (size_t i = 0; i < _crystal.millerCount(); i++)
+	if (stale)
 	{
-		bool onImage = _crystal.shouldDisplayMiller(i);
-
-		if (!onImage)
-		{
-			continue;
-		}
-		
-		double weight = _crystal.weightForMiller(i);
-		if (weight < 0) continue;
-		
-		vec3 pos = _crystal.position(i);
-		
-		QPen pen = QPen(QColor(0, 0, 255, (1 - weight) * 255));
-		bool watching = _crystal.isBeingWatched(i);
-		
-		if (_refineStage != 1) watching = false;
-		
-		QBrush brush(Qt::transparent);
-
-		if (watching)
-		{
-			brush = QBrush(QColor(0, 0, 255, 50));
-		}
-		
-		pos.x = w2 * pos.x / w + bx;
-		pos.y = h2 * pos.y / h + by;
-		
-		if (pos.x < 20 || pos.y < 20 || pos.x > w2 - 20 || pos.y > h2 - 20)
-		{
-			continue;
-		}
-
-		overlay->addEllipse(pos.x - ellipseSize / 2, pos.y - ellipseSize / 2,
-		 					ellipseSize, ellipseSize, pen, brush);	
+		layOutSpots(w, h, w2, h2, bx, by);
 	}
 	
 	/* Draw basis vectors for crystal in real space */
@@ -420,12 +453,11 @@ void Tinker::drawPredictions()
 	
 	for (size_t i = 0; i < 3; i++)
 	{
-		QPen pen = QPen(QColor(255, 0, 0));
 		vec3 basis_vector = mat3x3_axis(scaled_basis, i);
 		basis_vector.x += bx;
 		basis_vector.y += by;
 		
-		overlay->addLine(bx, by, basis_vector.x, basis_vector.y, pen);
+		_basisItems[i]->setLine(bx, by, basis_vector.x, basis_vector.y);
 	}
 	
 	/* Draw fixed axis, if exists */
@@ -433,10 +465,14 @@ void Tinker::drawPredictions()
 	
 	if (vec3_length(axis) > 0.5) // is set
 	{
-		QPen purple = QPen(QColor(255, 64, 255));
 		vec3_mult(&axis, 100);
-		overlay->addLine(-axis.x + bx, -axis.y + bx,
-						  axis.x + bx, axis.y + bx, purple);
+		_fixedAxisItem->setLine(-axis.x + bx, -axis.y + by,
+		                        axis.x + bx, axis.y + by);
+		_fixedAxisItem->show();
+	}
+	else
+	{
+		_fixedAxisItem->hide();
 	}
 }
 
@@ -519,7 +555,6 @@ void Tinker::receiveDialogue(DialogueType type, std::string diagString)
 		else
 		{
 			_crystal.setResolution(trial[0]);
-			_crystal.populateMillers();
 			drawPredictions();
 		}
 	}
@@ -563,7 +598,6 @@ void Tinker::receiveDialogue(DialogueType type, std::string diagString)
 		else
 		{
 			_crystal.setRlpSize(trial[0]);
-			_crystal.populateMillers();
 			drawPredictions();
 		}
 	}
@@ -596,7 +630,8 @@ void Tinker::openImage()
 {
 	delete fileDialogue;
 	fileDialogue = new QFileDialog(this, tr("Open images"),
-									 tr("Image Files (*.png *.jpg *.tif *.bmp)"));
+									 tr("Image Files (*.png *.jpg *.tif *.bmp "
+									    "*.raw *.bin)"));
 	fileDialogue->setFileMode(QFileDialog::AnyFile);
 	fileDialogue->show();
 	
@@ -610,10 +645,34 @@ void Tinker::openImage()
     
 	if (fileNames.size() >= 1)
 	{
-		if (!blankImage.load(fileNames[0]))
+		std::string filename = fileNames[0].toStdString();
+
+		/* Raw frames are mapped, not decoded; only what is shown gets
+		 * converted, in showRawImage. */
+		if (RawImage::recognise(filename))
 		{
-			qDebug("Error loading image");
-			return;
+			if (!_rawImage.load(filename))
+			{
+				qDebug("Error loading raw frame");
+				return;
+			}
+
+			_imageWidth = _rawImage.width();
+			_imageHeight = _rawImage.height();
+			_rawMaximum = _rawImage.suggestedMaximum();
+			_renderedSize = QSize();
+		}
+		else
+		{
+			if (!blankImage.load(fileNames[0]))
+			{
+				qDebug("Error loading image");
+				return;
+			}
+
+			_rawImage.close();
+			_imageWidth = blankImage.width();
+			_imageHeight = blankImage.height();
 		}
 
 		bool first = false;
@@ -623,21 +682,59 @@ void Tinker::openImage()
 			first = true;
 		}
 
-		std::string filename = fileNames[0].toStdString();
 		std::string newTitle = "Mandexing - " + getFilename(filename);
 		
 		this->setWindowTitle(newTitle.c_str());
 
 		_notice->hide();
-		imageLabel->setPixmap(blankImage);
+
+		if (_rawImage.width() > 0)
+		{
+			showRawImage();
+		}
+		else
+		{
+			imageLabel->setPixmap(blankImage);
+		}
+
+		_detector.setDetectorSize(_imageWidth, _imageHeight);
+
 		if (first)
 		{
-			_detector.setBeamCentre(blankImage.width() / 2,
-		   	                        blankImage.height() / 2);
+			_detector.setBeamCentre(_imageWidth / 2, _imageHeight / 2);
 		}
+
+		drawPredictions();
 	}
 }
 
+void Tinker::showRawImage()
+{
+	int w = imageLabel->width();
+	int h = imageLabel->height();
+
+	if (_rawImage.width() == 0 || w <= 0 || h <= 0 ||
+	    _renderedSize == QSize(w, h))
+	{
+		return;
+	}
+
+	/* One pixel per screen pixel, in strips across the thread pool */
+	QImage image(w, h, QImage::Format_Grayscale8);
+	uchar *bits = image.bits();
+	int stride = image.bytesPerLine();
+
+	ThreadPool::pool()->parallelFor(h, 32, [&](size_t start, size_t end, int)
+	{
+		_rawImage.render(0, 0, _imageWidth, _imageHeight, w, h, start, end,
+		                 _rawMaximum, bits, stride);
+	});
+
+	blankImage = QPixmap::fromImage(image);
+	imageLabel->setPixmap(blankImage);
+	_renderedSize = QSize(w, h);
+}
+
 void Tinker::loadMatrix()
 {
 	delete fileDialogue;
@@ -655,100 +752,57 @@ void Tinker::loadMatrix()
     if (fileNames.size() >= 1)
 	{
 		std::string filename = fileNames[0].toStdString();
-		std::string matrix = get_file_contents(filename);
-		
-		std::vector<std::string> lines = split(matrix, '\n');
-		
-		QMessageBox *msgBox = new QMessageBox(this);
-		msgBox->setStandardButtons(QMessageBox::Ok);
-		msgBox->setDefaultButton(QMessageBox::Ok);
-		msgBox->setWindowModality(Qt::NonModal);
-		msgBox->setText("Sorry no");
-		
-		for (size_t i = 0; i < lines.size(); i++)
+		std::string error;
+
+		if (!load_state_file(filename, &_crystal, &_detector, &error))
 		{
-			std::vector<std::string> components = split(lines[i], ' ');
-			
-			if (components.size() == 0)
-			{
-				continue;
-			}
+			QMessageBox *msgBox = new QMessageBox(this);
+			msgBox->setStandardButtons(QMessageBox::Ok);
+			msgBox->setDefaultButton(QMessageBox::Ok);
+			msgBox->setText("Sorry no");
+			msgBox->setInformativeText(QString::fromStdString(error));
+			msgBox->exec();
+			delete msgBox;
+		}
 
-			if (components[0] == "rotation" || components[0] == "unitcell")
-			{
-				if (components.size() < 10)
-				{
-					msgBox->setInformativeText("Not enough components,"\
-					                           "expecting 9 space-separated "\
-					                           "values. Try again.");
-					msgBox->exec();
-				}
-			}
+		drawPredictions();
+	}
+}
+    
+void Tinker::loadGeometry()
+{
+	delete fileDialogue;
+	fileDialogue = new QFileDialog(this, tr("Load detector geometry"),
+									 tr("CrystFEL geometry file (*.geom)"));
+	fileDialogue->setFileMode(QFileDialog::AnyFile);
+	fileDialogue->show();
 
-			if (components[0] == "rotation")
-			{
-				mat3x3 rotMat = mat3x3_from_string(components);
-				_crystal.setRotation(rotMat);
-			}
+	QStringList fileNames;
+	if (fileDialogue->exec())
+	{
+		fileNames = fileDialogue->selectedFiles();
+	}
 
-			if (components[0] == "unitcell")
-			{
-				mat3x3 unitCell = mat3x3_from_string(components);
-				_crystal.setUnitCell(unitCell);
-			}
+	if (fileNames.size() >= 1)
+	{
+		std::string filename = fileNames[0].toStdString();
 
-			if (components[0] == "det_centre")
-			{
-				if (components.size() < 4)
-				{
-					msgBox->setInformativeText("Not enough components,"\
-					                           "expecting 3 space-separated "\
-					                           "values. Try again.");
-					msgBox->exec();
-				}
-
-				vec3 centre = vec3_from_string(components);
-				_detector.setBeamCentre(centre.x, centre.y);
-				_detector.setDetectorDistance(centre.z);
-			}
-			
-			if (components[0] == "wavelength")
-			{
-				if (components.size() < 2)
-				{
-					msgBox->setInformativeText("Not enough components,"\
-					                           "expecting 1 "\
-					                           "value. Try again.");
-					msgBox->exec();
-				}
-
-				double wave = atof(components[1].c_str());
-				_detector.setWavelength(wave);
-				_crystal.setWavelength(wave);
-			}
-			
-			if (components[0] == "rlp_size")
-			{
-				if (components.size() < 2)
-				{
-					msgBox->setInformativeText("Not enough components,"\
-					                           "expecting 1 "\
-					                           "value. Try again.");
-					msgBox->exec();
-				}
-
-				double rlp_size = atof(components[1].c_str());
-				_crystal.setRlpSize(rlp_size);
-			}
+		if (!_detector.loadGeometry(filename))
+		{
+			QMessageBox *msgBox = new QMessageBox(this);
+			msgBox->setStandardButtons(QMessageBox::Ok);
+			msgBox->setDefaultButton(QMessageBox::Ok);
+			msgBox->setText("Could not load geometry");
+			msgBox->setInformativeText("See the terminal for details.");
+			msgBox->exec();
+			delete msgBox;
+			return;
 		}
 
-		_crystal.populateMillers();
 		drawPredictions();
-		
-		delete msgBox;
 	}
 }
-    
+
 void Tinker::saveMatrix()
 {
 	delete fileDialogue;
@@ -766,29 +820,7 @@ void Tinker::saveMatrix()
     
     if (fileNames.size() >= 1)
 	{
-		std::ofstream file;
-		file.open(fileNames[0].toStdString().c_str());
-		
-		mat3x3 rot = _crystal.getRotation();
-		mat3x3 unitCell = _crystal.getUnitCell();
-		vec3 beamCentre = _detector.getBeamCentre();
-		
-		file << "rotation ";
-		file << computer_friendly_desc(rot);
-		
-		file << "unitcell ";
-		file << computer_friendly_desc(unitCell);
-		
-		file << "det_centre ";
-		file << computer_friendly_desc(beamCentre);
-		
-		file << "wavelength ";
-		file << _detector.getWavelength() << std::endl;
-
-		file << "rlp_size ";
-		file << _crystal.getRlpSize() << std::endl;
-
-		file.close();
+		save_state_file(fileNames[0].toStdString(), &_crystal, &_detector);
 	}
 }
 
@@ -818,7 +850,6 @@ void Tinker::finishFixAxis()
 void Tinker::changeLattice(BravaisLatticeType type)
 {
 	_crystal.setBravaisLattice(type);
-	_crystal.populateMillers();
 	drawPredictions();
 }
 
@@ -827,22 +858,78 @@ void Tinker::startRefinement()
 	_refineStage = 2;
 	bRefine->setText("Refining...");
 	
-	NelderMeadPtr mead = NelderMeadPtr(new NelderMead());
-	mead->setEvaluationFunction(Crystal::ewaldSphereClosenessScore, &_crystal);
-	mead->addParameter(&_crystal, Crystal::getHorizontal, Crystal::setHorizontal, 0.002, 0.0002);
-	mead->addParameter(&_crystal, Crystal::getVertical, Crystal::setVertical, 0.002, 0.0002);
-	mead->setCycles(15);
-	mead->refine();
+	/* the user's own nudge, put back if the run is cancelled */
+	_refineHoriz = Crystal::getHorizontal(&_crystal);
+	_refineVert = Crystal::getVertical(&_crystal);
 	
-	_crystal.clearUpRefinement();
-	_refineStage = 0;
-	bRefine->setText("Refine");
+	RefinementRunner *runner = new RefinementRunner(&_crystal, this);
+	connect(runner, &RefinementRunner::progress,
+	        this, &Tinker::refinementProgress);
+	connect(runner, &QThread::finished,
+	        this, [=]{ refinementFinished(runner); });
+	_runners.push_back(runner);
+	
+	runner->start();
+}
+
+void Tinker::refinementProgress(int cycle, double score,
+                                QList<double> parameters)
+{
+	bRefine->setText(("Refining... " + i_to_str(cycle)).c_str());
+
+	/* Preview the nudge; the rotation is only changed on completion */
+	Crystal::setHorizontal(&_crystal, parameters[0]);
+	Crystal::setVertical(&_crystal, parameters[1]);
+	drawPredictions();
 	
-//	QtConcurrent::run(RefinementStrategy::run, &*mead);
+	std::cout << "Refinement cycle " << cycle << ", score " << score
+	<< std::endl;
+}
+
+void Tinker::refinementFinished(RefinementRunner *runner)
+{
+	_runners.erase(std::find(_runners.begin(), _runners.end(), runner));
+
+	if (!runner->wasCancelled())
+	{
+		Crystal::setHorizontal(&_crystal, 0);
+		Crystal::setVertical(&_crystal, 0);
+		_crystal.clearUpRefinement();
+		_crystal.setRotation(runner->result()->getRotation());
+	}
+	else
+	{
+		/* nothing is applied: undo the preview, and start the next
+		 * pick from an empty set */
+		Crystal::setHorizontal(&_crystal, _refineHoriz);
+		Crystal::setVertical(&_crystal, _refineVert);
+		_crystal.clearWatched();
+	}
+
+	runner->deleteLater();
+
+	if (_runners.size() == 0)
+	{
+		_refineStage = 0;
+		bRefine->setText("Refine");
+	}
+
+	drawPredictions();
 }
 
 void Tinker::refineClicked()
 {
+	if (_refineStage == 2)
+	{
+		for (size_t i = 0; i < _runners.size(); i++)
+		{
+			_runners[i]->cancel();
+		}
+
+		bRefine->setText("Cancelling...");
+		return;
+	}
+
 	if (_refineStage == 0)
 	{
 		_detector.prepareLookupTable();
@@ -853,8 +940,10 @@ void Tinker::refineClicked()
 	else
 	{
 		bRefine->setText("Refine");
+		_refineStage = 0;
+
+		/* starts the refinement, which takes us to stage 2 */
 		overlayView->setRefineStage(0);
-		_refineStage = 0;		
 	}
 }
 
@@ -879,6 +968,12 @@ void Tinker::identifyHkl()
 
 Tinker::~Tinker()
 {
+	for (size_t i = 0; i < _runners.size(); i++)
+	{
+		_runners[i]->cancel();
+		_runners[i]->wait();
+	}
+
 	delete bUnitCell;
 	delete imageLabel;
 }
@@ -34,6 +34,9 @@
 #include <QtWidgets/qgraphicsview.h>
 #include "Crystal.h"
 #include "PredictionView.h"
+#include "PredictionOverlay.h"
+#include "RefinementRunner.h"
+#include "RawImage.h"
 #include <vector>
 #include <QtCore/qsignalmapper.h>
 
@@ -119,6 +122,7 @@ private slots:
     void openImage();
     void saveMatrix();
     void loadMatrix();
+    void loadGeometry();
     
     /* Process */
 	
@@ -127,16 +131,48 @@ private slots:
 
 private:
 	void changeBeamCentre(double deltaX, double deltaY);
+	void showRawImage();
+	void layOutSpots(double w, double h, double w2, double h2,
+	                 double bx, double by);
+	void refinementProgress(int cycle, double score,
+	                        QList<double> parameters);
+	void refinementFinished(RefinementRunner *runner);
 	QLabel *_notice;
 	
+	/* Overlay items, kept for the life of the scene */
+	PredictionOverlay *_spotItem;
+	QGraphicsLineItem *_basisItems[3];
+	QGraphicsLineItem *_fixedAxisItem;
+	
 	
 	std::vector<double> _unitCell;
 	Crystal _crystal;
 	Detector _detector;
 
+	/* Size of the loaded frame in detector pixels; blankImage may hold
+	 * a smaller rendering of it. */
+	int _imageWidth;
+	int _imageHeight;
+
+	/* Raw frames stay mapped and are rendered at the size shown */
+	RawImage _rawImage;
+	double _rawMaximum;
+	QSize _renderedSize;
+
 	int _identifyHklStage;
 	int _fixAxisStage;
 	int _refineStage;
+	std::vector<RefinementRunner *> _runners;
+	double _refineHoriz, _refineVert;
+
+	/* What the spots were last laid out from; they are only laid out
+	 * again once one of these has changed. */
+	bool _spotsDrawn;
+	unsigned long _drawnDetector;
+	unsigned long _drawnWatch;
+	int _drawnRefineStage;
+	QRectF _drawnView;
+	QSize _drawnImage;
 };
 
 #endif /* defined(__CaroCode__QTinker__) */
@@ -17,13 +17,89 @@
 // Please email: vagabond @ hginn.co.uk for more details.
 
 #include <iostream>
+#include <string>
 #include <QtCore/qglobal.h>
 #include <QtWidgets/qapplication.h>
 #include "Tinker.h"
+#include "BatchPrediction.h"
+#include "ThreadPool.h"
+#include "RefinementStrategy.h"
+
+static void usage(char *program)
+{
+    std::cout << "Usage: " << program << " [--threads N] [--batch <list.txt>]"
+    << " [--geometry <file.geom>]"
+    << " [--minimizer nelder-mead|least-squares|grid]\n"
+    << "Each line of list.txt: matrix.dat width height" << std::endl;
+}
 
 int main(int argc, char * argv[])
 {
-    // insert code here...
+    std::string batchList;
+    std::string geometry;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg != "--threads" && arg != "--batch" && arg != "--minimizer"
+            && arg != "--geometry")
+        {
+            continue;
+        }
+
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+
+        if (arg == "--threads")
+        {
+            ThreadPool::setThreadCount(atoi(argv[++i]));
+        }
+        else if (arg == "--minimizer")
+        {
+            std::string name = argv[++i];
+
+            if (name == "least-squares")
+            {
+                RefinementStrategy::setUserChosenMethod
+                (MinimizationMethodLevenbergMarquardt);
+            }
+            else if (name == "grid")
+            {
+                RefinementStrategy::setUserChosenMethod
+                (MinimizationMethodGridSearch);
+            }
+            else if (name != "nelder-mead")
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (arg == "--geometry")
+        {
+            geometry = argv[++i];
+        }
+        else
+        {
+            batchList = argv[++i];
+        }
+    }
+
+    /* Headless prediction: no QApplication, no widgets */
+    if (batchList.length())
+    {
+        BatchPrediction batch;
+
+        if (geometry.length() && !batch.loadGeometry(geometry))
+        {
+            return 1;
+        }
+
+        return batch.run(batchList);
+    }
 
     std::cout << "Qt version: " << qVersion() << std::endl;
     
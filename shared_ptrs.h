@@ -32,10 +32,12 @@ class RefinementGridSearch;
 class RefinementStepSearch;
 class RefinementStrategy;
 class NelderMead;
+class RefinementLevenbergMarquardt;
 typedef boost::shared_ptr<RefinementStepSearch> RefinementStepSearchPtr;
 typedef boost::shared_ptr<RefinementGridSearch> RefinementGridSearchPtr;
 typedef boost::shared_ptr<RefinementStrategy> RefinementStrategyPtr;
 typedef boost::shared_ptr<NelderMead> NelderMeadPtr;
+typedef boost::shared_ptr<RefinementLevenbergMarquardt> RefinementLevenbergMarquardtPtr;
 
 class CSV;
 class PNGFile;